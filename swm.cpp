@@ -1,12 +1,40 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <csignal>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <ranges>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 #include <oneapi/tbb/profiling.h>
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_ewmh.h>
+#include <xcb/sync.h>
+#include "swm_state.h"
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
 
 constexpr xcb_keycode_t KEYCODE_RETURN = 36;
 constexpr xcb_keycode_t KEYCODE_ESCAPE = 9;
@@ -18,6 +46,7 @@ constexpr xcb_keycode_t KEYCODE_J = 44;
 constexpr xcb_keycode_t KEYCODE_K = 45;
 constexpr xcb_keycode_t KEYCODE_L = 46;
 constexpr xcb_keycode_t KEYCODE_D = 40;
+constexpr xcb_keycode_t KEYCODE_F = 41;
 constexpr xcb_keycode_t KEYCODE_PLUS = 21;
 constexpr xcb_keycode_t KEYCODE_MINUS = 20;
 constexpr xcb_keycode_t KEYCODE_1 = 10;
@@ -29,11 +58,115 @@ constexpr xcb_keycode_t KEYCODE_6 = 15;
 constexpr xcb_keycode_t KEYCODE_7 = 16;
 constexpr xcb_keycode_t KEYCODE_8 = 17;
 constexpr xcb_keycode_t KEYCODE_9 = 18;
-constexpr int MAX_WORKSPACES = 9;
+constexpr xcb_keycode_t KEYCODE_0 = 19;
+constexpr xcb_keycode_t KEYCODE_GRAVE = 49;
+constexpr xcb_keycode_t KEYCODE_N = 57;
+constexpr xcb_keycode_t KEYCODE_TAB = 23;
+constexpr xcb_keycode_t KEYCODE_BACKSPACE = 22;
+// Workspaces are created on demand; this only bounds the ids bindings and
+// clients may ask for.
+constexpr int WORKSPACE_LIMIT = 1000;
 int gap_size = 20;
 float master_ratio = 0.6f;
 std::vector<xcb_window_t> floating_windows;
 
+// Runtime configuration, parsed from the config file in one pass and never
+// modified afterwards. A reload builds a new Config and swaps the pointer.
+enum class Action {
+    Spawn, Quit, Kill, ToggleFloating, ToggleFullscreen, FocusNext, FocusPrev, MoveDown, MoveUp,
+    GapIncrease, GapDecrease, RatioDecrease, RatioIncrease, Workspace, MoveToWorkspace,
+    ToggleScratchpad, AssignScratchpad, FocusLast, FocusCycle, FocusCycleBack,
+    WorkspaceNext, WorkspacePrev, WorkspaceNew
+};
+
+struct KeyBinding {
+    uint16_t modifiers = 0;
+    xcb_keycode_t keycode = 0;
+    Action action = Action::Spawn;
+    int argument = 0; // workspace or scratchpad index
+    std::string command;
+
+    bool same_key(const KeyBinding& other) const { return modifiers == other.modifiers && keycode == other.keycode; }
+    bool operator==(const KeyBinding&) const = default;
+};
+
+struct Rgb {
+    uint16_t red, green, blue;
+    bool operator==(const Rgb&) const = default;
+};
+
+// Live configures the window on every motion event, Wireframe only draws an
+// outline until the button is released, Paced configures at most once per
+// display refresh.
+enum class DragMode { Live, Wireframe, Paced };
+
+// What happens to a client's process while none of its windows are visible.
+// Stop sends SIGSTOP/SIGCONT, Cgroup moves it into throttle_cgroup and back.
+enum class FreezePolicy { None, Stop, Cgroup };
+
+struct Config {
+    int gap_size = 20;
+    float master_ratio = 0.6f;
+    Rgb focused_border = {65535, 42405, 0};
+    Rgb unfocused_border = {30000, 30000, 30000};
+    bool focus_follows_mouse = false; // focus clients on EnterNotify as well as on click
+    std::vector<KeyBinding> bindings;
+    // "drag = <class> live|wireframe|paced", matched against the class part of
+    // WM_CLASS. Clients that aren't listed are dragged live.
+    std::vector<std::pair<std::string, DragMode>> drag_rules;
+    // "freeze = <class> none|stop|cgroup", matched the same way. Clients that
+    // aren't listed keep running while hidden.
+    std::vector<std::pair<std::string, FreezePolicy>> freeze_rules;
+};
+std::shared_ptr<const Config> config;
+std::string config_path;
+int config_inotify_fd = -1;
+
+constexpr const char* DEFAULT_BINDINGS = R"(
+bind = super+Return spawn st
+bind = super+d spawn dmenu_run
+bind = super+Escape quit
+bind = super+q kill
+bind = super+space floating
+bind = super+f fullscreen
+bind = super+j focus_next
+bind = super+k focus_prev
+bind = super+BackSpace focus_last
+bind = super+Tab focus_cycle
+bind = super+shift+Tab focus_cycle_back
+bind = super+shift+j move_down
+bind = super+shift+k move_up
+bind = super+plus gap_increase
+bind = super+minus gap_decrease
+bind = super+h ratio_decrease
+bind = super+l ratio_increase
+bind = super+grave scratchpad term
+bind = super+shift+grave scratchpad_assign term
+bind = super+n scratchpad notes
+bind = super+shift+n scratchpad_assign notes
+bind = super+1 workspace 1
+bind = super+2 workspace 2
+bind = super+3 workspace 3
+bind = super+4 workspace 4
+bind = super+5 workspace 5
+bind = super+6 workspace 6
+bind = super+7 workspace 7
+bind = super+8 workspace 8
+bind = super+9 workspace 9
+bind = super+0 workspace_new
+bind = super+ctrl+l workspace_next
+bind = super+ctrl+h workspace_prev
+bind = super+shift+1 move_to_workspace 1
+bind = super+shift+2 move_to_workspace 2
+bind = super+shift+3 move_to_workspace 3
+bind = super+shift+4 move_to_workspace 4
+bind = super+shift+5 move_to_workspace 5
+bind = super+shift+6 move_to_workspace 6
+bind = super+shift+7 move_to_workspace 7
+bind = super+shift+8 move_to_workspace 8
+bind = super+shift+9 move_to_workspace 9
+)";
+
 xcb_window_t focused_client_window = XCB_WINDOW_NONE;
 std::vector<xcb_window_t> client_windows;
 uint32_t focused_border;
@@ -47,32 +180,661 @@ struct EwmhAtoms {
     xcb_atom_t _NET_ACTIVE_WINDOW;
     xcb_atom_t _NET_WM_STATE;
     xcb_atom_t _NET_WM_STATE_FULLSCREEN;
+    xcb_atom_t _NET_WM_STATE_HIDDEN;
     xcb_atom_t _NET_WM_WINDOW_TYPE;
     xcb_atom_t _NET_WM_WINDOW_TYPE_DIALOG;
+    xcb_atom_t _NET_WM_WINDOW_TYPE_DOCK;
     xcb_atom_t _NET_CLIENT_LIST;
     xcb_atom_t _NET_CLIENT_LIST_STACKING;
     xcb_atom_t _NET_WM_DESKTOP;
     xcb_atom_t _NET_WM_NAME;
     xcb_atom_t _NET_DESKTOP_NAMES;
     xcb_atom_t _NET_WORKAREA;
+    xcb_atom_t _NET_WM_PID;
+    xcb_atom_t _NET_WM_STRUT;
+    xcb_atom_t _NET_WM_STRUT_PARTIAL;
+    xcb_atom_t _NET_WM_SYNC_REQUEST;
+    xcb_atom_t _NET_WM_SYNC_REQUEST_COUNTER;
 } ewmh;
 
+struct SwmAtoms {
+    xcb_atom_t UTF8_STRING;
+    xcb_atom_t WM_PROTOCOLS;
+    xcb_atom_t _SWM_CLIENT_INFO; // snapshot of all clients for switchers, see publish_client_info()
+    xcb_atom_t _SWM_SWITCH_QUERY; // set on the root window to focus the best fuzzy match
+    xcb_atom_t _SWM_FROZEN_PROCESSES; // see publish_frozen_processes()
+} swm_atoms;
+bool client_info_dirty = false;
+std::vector<xcb_window_t> metadata_pending;
+
 
 struct DragState {
     bool is_dragging = false;
     bool is_resizing = false;
+    DragMode mode = DragMode::Live;
     xcb_window_t dragged_window = XCB_WINDOW_NONE;
     int start_x{}, start_y{};
     int start_width{}, start_height{};
     int start_win_x{}, start_win_y{};
+    int x{}, y{}, width{}, height{};
+    bool outline_drawn = false;
+    bool configure_pending = false;
 } drag_state;
 
+DragMode default_drag_mode = DragMode::Live;
+int drag_refresh_hz = 60;
+int drag_timer_fd = -1;
+
+// The XSync extension carries _NET_WM_SYNC_REQUEST acknowledgements. A
+// client that hasn't drawn its previous size within sync_timeout_ms gets the
+// next geometry anyway.
+struct SyncExtension {
+    bool present = false;
+    uint8_t first_event = 0;
+} sync_extension;
+int sync_timeout_ms = 100;
+int sync_timer_fd = -1;
+std::vector<xcb_window_t> sync_waiting; // oldest request first
+std::unordered_map<xcb_sync_alarm_t, xcb_window_t> sync_alarms;
+xcb_gcontext_t wireframe_gc = XCB_NONE;
+
+// X events a client caused, as opposed to the ones swm caused itself.
+struct ClientEventCounts {
+    uint32_t configure_requests = 0;
+    uint32_t focus_changes = 0;
+    uint32_t maps = 0;
+    uint32_t unmaps = 0;
+
+    uint32_t total() const { return configure_requests + focus_changes + maps + unmaps; }
+};
+
+// Titles and classes repeat a lot across windows and over time, so they are
+// stored once in a reference-counted pool. Each entry keeps a lowercased copy
+// for case-insensitive fuzzy matching.
+struct StringPool {
+    struct Entry {
+        std::string text;
+        std::string folded;
+        uint32_t references = 0;
+    };
+    std::deque<Entry> entries = { Entry{} }; // id 0 is the empty string and never freed
+    std::unordered_map<std::string_view, uint32_t> index;
+    std::vector<uint32_t> free_ids;
+
+    uint32_t acquire(std::string_view text) {
+        if (text.empty()) return 0;
+        if (auto it = index.find(text); it != index.end()) {
+            entries[it->second].references++;
+            return it->second;
+        }
+        uint32_t id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else {
+            id = entries.size();
+            entries.emplace_back();
+        }
+        Entry& entry = entries[id];
+        entry.text.assign(text);
+        entry.folded.resize(text.size());
+        std::transform(text.begin(), text.end(), entry.folded.begin(), [](unsigned char c) { return tolower(c); });
+        entry.references = 1;
+        index.emplace(entry.text, id);
+        return id;
+    }
+
+    void release(uint32_t id) {
+        if (id == 0 || --entries[id].references > 0) return;
+        index.erase(entries[id].text);
+        entries[id].text.clear();
+        entries[id].folded.clear();
+        free_ids.push_back(id);
+    }
+} string_pool;
+
+class InternedString {
+public:
+    InternedString() = default;
+    explicit InternedString(std::string_view text) : id_(string_pool.acquire(text)) {}
+    InternedString(const InternedString& other) : id_(other.id_) {
+        if (id_) string_pool.entries[id_].references++;
+    }
+    InternedString(InternedString&& other) noexcept : id_(std::exchange(other.id_, 0)) {}
+    InternedString& operator=(InternedString other) noexcept {
+        std::swap(id_, other.id_);
+        return *this;
+    }
+    ~InternedString() { string_pool.release(id_); }
+
+    std::string_view view() const { return string_pool.entries[id_].text; }
+    std::string_view folded() const { return string_pool.entries[id_].folded; }
+    bool operator==(const InternedString& other) const { return id_ == other.id_; }
+    bool operator==(std::string_view text) const { return view() == text; }
+
+private:
+    uint32_t id_ = 0;
+};
+
+std::ostream& operator<<(std::ostream& out, const InternedString& text) {
+    return out << text.view();
+}
+
+// _NET_WM_SYNC_REQUEST bookkeeping, see configure_client(). counter stays 0
+// for clients that don't support the protocol.
+struct ClientSync {
+    xcb_sync_counter_t counter = 0;
+    xcb_sync_alarm_t alarm = 0;
+    int64_t value = 0; // last value the client was asked to reach
+    bool value_known = false;
+    xcb_sync_query_counter_cookie_t initial_value{};
+    bool waiting = false;
+    std::chrono::steady_clock::time_point requested_at;
+    uint16_t pending_mask = 0; // geometry that arrived while waiting, merged to the latest
+    std::array<uint32_t, 5> pending{}; // x, y, width, height, border width
+    uint32_t width = 0, height = 0; // last size sent
+    uint32_t acks = 0;
+    uint32_t timeouts = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+};
+
+// Per-window data that outlives a single event, keyed by client window.
+struct Client {
+    InternedString wm_instance;
+    InternedString wm_class;
+    InternedString title; // _NET_WM_NAME, or WM_NAME for clients that don't set it
+    bool metadata_stale = false; // queued for the end-of-batch property fetch
+    pid_t pid = 0; // 0 when _NET_WM_PID is missing or names a process on another host
+    bool hidden = false; // mirrored into _NET_WM_STATE
+    bool fullscreen = false; // mirrored into _NET_WM_STATE
+    int saved_x{}, saved_y{}, saved_width{}, saved_height{}; // floating geometry before fullscreen
+    ClientEventCounts events;
+    uint32_t events_at_last_sample = 0;
+    uint32_t expected_unmaps = 0; // UnmapNotify events swm caused and should not be counted
+    bool event_alert = false;
+    uint32_t x_errors = 0;
+    // Links in the most-recently-used list of the workspace the window is on.
+    xcb_window_t mru_prev = XCB_WINDOW_NONE;
+    xcb_window_t mru_next = XCB_WINDOW_NONE;
+    int workspace = -1; // -1 while on no workspace, e.g. for scratchpads
+    int x = 0, y = 0, width = 0, height = 0; // last ConfigureNotify
+    bool click_grabbed = false; // see set_click_grab()
+    ClientSync sync;
+};
+std::unordered_map<xcb_window_t, Client> clients;
+
+// Errors from unchecked requests arrive asynchronously in the event queue.
+// Requests on client windows record their sequence number here so an error
+// can be traced back to the window it was sent for without a round trip.
+struct TrackedRequest {
+    uint32_t sequence = 0;
+    xcb_window_t window = XCB_WINDOW_NONE;
+};
+constexpr size_t TRACKED_REQUESTS = 1024;
+std::array<TrackedRequest, TRACKED_REQUESTS> tracked_requests;
+
+struct XErrorStats {
+    uint64_t total = 0;
+    uint64_t expected = 0; // errors on windows that were already gone
+    std::array<uint32_t, 256> by_opcode{};
+} x_error_stats;
+
+// Static tracepoints swm:span_begin and swm:span_end (name, window) for perf,
+// bpftrace and friends; without <sys/sdt.h> they compile to nothing. Setting
+// SWM_TRACE to a path additionally records every span as a Chrome/Perfetto
+// JSON timeline. With both off a span costs one predictable branch.
+#ifdef DTRACE_PROBE2
+#define SWM_PROBE(probe, name, window) DTRACE_PROBE2(swm, probe, name, window)
+#else
+#define SWM_PROBE(probe, name, window) ((void)(name), (void)(window))
+#endif
+
+struct Trace {
+    bool enabled = false;
+    std::ofstream out;
+    std::string buffer;
+    bool first_event = true;
+    std::chrono::steady_clock::time_point origin;
+} trace;
+
+void open_trace() {
+    const char* path = getenv("SWM_TRACE");
+    if (!path || !*path) return;
+    trace.out.open(path, std::ios::trunc);
+    if (!trace.out) {
+        std::cerr << "Cannot write trace to " << path << std::endl;
+        return;
+    }
+    trace.enabled = true;
+    trace.origin = std::chrono::steady_clock::now();
+    trace.buffer = "[\n";
+    std::cout << "Tracing to " << path << std::endl;
+}
+
+void flush_trace() {
+    trace.out << trace.buffer;
+    trace.out.flush();
+    trace.buffer.clear();
+}
+
+void close_trace() {
+    if (!trace.enabled) return;
+    trace.buffer += "\n]\n";
+    flush_trace();
+    trace.enabled = false;
+}
+
+void record_trace_span(const char* name, xcb_window_t window, std::chrono::steady_clock::time_point start) {
+    auto now = std::chrono::steady_clock::now();
+    auto micros = [](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    if (!trace.first_event) trace.buffer += ",\n";
+    trace.first_event = false;
+    trace.buffer += "{\"name\":\"";
+    trace.buffer += name;
+    trace.buffer += "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":";
+    trace.buffer += std::to_string(micros(start - trace.origin));
+    trace.buffer += ",\"dur\":";
+    trace.buffer += std::to_string(micros(now - start));
+    if (window != XCB_WINDOW_NONE) {
+        trace.buffer += ",\"args\":{\"window\":";
+        trace.buffer += std::to_string(window);
+        trace.buffer += "}";
+    }
+    trace.buffer += "}";
+    if (trace.buffer.size() > 64 * 1024) flush_trace();
+}
+
+// Marks the lifetime of a scope as a span.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, xcb_window_t window = XCB_WINDOW_NONE) : name_(name), window_(window) {
+        SWM_PROBE(span_begin, name_, window_);
+        if (trace.enabled) start_ = std::chrono::steady_clock::now();
+    }
+    ~TraceSpan() {
+        SWM_PROBE(span_end, name_, window_);
+        if (trace.enabled) record_trace_span(name_, window_, start_);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name_;
+    xcb_window_t window_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+const char* x_event_name(uint8_t type) {
+    switch (type) {
+        case 0: return "Error";
+        case XCB_KEY_PRESS: return "KeyPress";
+        case XCB_KEY_RELEASE: return "KeyRelease";
+        case XCB_BUTTON_PRESS: return "ButtonPress";
+        case XCB_BUTTON_RELEASE: return "ButtonRelease";
+        case XCB_MOTION_NOTIFY: return "MotionNotify";
+        case XCB_FOCUS_IN: return "FocusIn";
+        case XCB_ENTER_NOTIFY: return "EnterNotify";
+        case XCB_DESTROY_NOTIFY: return "DestroyNotify";
+        case XCB_UNMAP_NOTIFY: return "UnmapNotify";
+        case XCB_MAP_REQUEST: return "MapRequest";
+        case XCB_CONFIGURE_NOTIFY: return "ConfigureNotify";
+        case XCB_CONFIGURE_REQUEST: return "ConfigureRequest";
+        case XCB_PROPERTY_NOTIFY: return "PropertyNotify";
+        case XCB_CLIENT_MESSAGE: return "ClientMessage";
+        default: return "OtherEvent";
+    }
+}
+
+// The window an event is about, for tagging its dispatch span.
+xcb_window_t x_event_window(const xcb_generic_event_t* event) {
+    switch (event->response_type & ~0x80) {
+        case XCB_KEY_PRESS:
+        case XCB_KEY_RELEASE: return ((const xcb_key_press_event_t*)event)->event;
+        case XCB_BUTTON_PRESS:
+        case XCB_BUTTON_RELEASE: return ((const xcb_button_press_event_t*)event)->event;
+        case XCB_MOTION_NOTIFY: return ((const xcb_motion_notify_event_t*)event)->event;
+        case XCB_FOCUS_IN: return ((const xcb_focus_in_event_t*)event)->event;
+        case XCB_ENTER_NOTIFY: return ((const xcb_enter_notify_event_t*)event)->event;
+        case XCB_DESTROY_NOTIFY: return ((const xcb_destroy_notify_event_t*)event)->window;
+        case XCB_UNMAP_NOTIFY: return ((const xcb_unmap_notify_event_t*)event)->window;
+        case XCB_MAP_REQUEST: return ((const xcb_map_request_event_t*)event)->window;
+        case XCB_CONFIGURE_NOTIFY: return ((const xcb_configure_notify_event_t*)event)->window;
+        case XCB_CONFIGURE_REQUEST: return ((const xcb_configure_request_event_t*)event)->window;
+        case XCB_PROPERTY_NOTIFY: return ((const xcb_property_notify_event_t*)event)->window;
+        case XCB_CLIENT_MESSAGE: return ((const xcb_client_message_event_t*)event)->window;
+        default: return XCB_WINDOW_NONE;
+    }
+}
+
+// Resource sampling of client processes from /proc. 0 disables sampling.
+int resource_sample_interval_ms = 5000;
+double cpu_percent_threshold = 80.0;
+long rss_threshold_kb = 2 * 1024 * 1024;
+uint32_t events_per_sample_threshold = 500;
+int resource_timer_fd = -1;
+int signal_fd = -1;
+
+struct ProcessSample {
+    uint64_t cpu_ticks = 0;
+    double cpu_percent = 0;
+    long rss_kb = 0;
+    bool seen = false;
+    bool cpu_alert = false;
+    bool rss_alert = false;
+};
+std::unordered_map<pid_t, ProcessSample> process_samples;
+
+const char* throttle_cgroup = "/sys/fs/cgroup/swm-background";
+
+struct FrozenProcess {
+    FreezePolicy policy = FreezePolicy::None;
+    int workspace = 0;
+    std::chrono::steady_clock::time_point frozen_at;
+    uint64_t cpu_ticks_at_freeze = 0;
+    double lifetime_ticks_per_second = 0; // estimate of what the process would have burnt
+    std::string original_cgroup;
+};
+std::unordered_map<pid_t, FrozenProcess> frozen_processes;
+bool frozen_processes_dirty = false;
+
+// Space reserved at the screen edges by a dock (_NET_WM_STRUT[_PARTIAL]).
+struct Strut {
+    uint32_t left = 0, right = 0, top = 0, bottom = 0;
+    bool operator==(const Strut&) const = default;
+};
+// Docks are mapped and tracked for their struts but never tiled or focused.
+std::unordered_map<xcb_window_t, Strut> docks;
+
+// The screen minus all struts. Only recomputed when a strut changes.
+struct WorkArea {
+    int x = 0, y = 0, width = 0, height = 0;
+    bool operator==(const WorkArea&) const = default;
+} work_area;
+
 struct Workspaces {
     std::vector<xcb_window_t> windows;
     xcb_window_t focused_window = XCB_WINDOW_NONE;
+    // While set, only this window is mapped and the workspace is not tiled.
+    xcb_window_t fullscreen_window = XCB_WINDOW_NONE;
+    // Most recently focused first, linked through Client::mru_prev/mru_next so
+    // touching or dropping a window never walks the list.
+    xcb_window_t mru_head = XCB_WINDOW_NONE;
+    xcb_window_t mru_tail = XCB_WINDOW_NONE;
 };
-std::array<Workspaces, MAX_WORKSPACES> workspaces;
+// Sparse by id: a workspace exists while it holds windows or is the current
+// one, so loops over workspaces only visit those in use.
+std::map<int, Workspaces> workspaces;
 int current_workspace = 0;
+// CPU time saved by freezing, per workspace id. Kept apart from workspaces so
+// the total survives the workspace emptying and being released.
+std::map<int, double> workspace_cpu_seconds_saved;
+bool desktops_dirty = true; // the set of workspaces changed since _NET_NUMBER_OF_DESKTOPS was published
+
+// Super+Tab walks the MRU list without reordering it; the window reached is
+// only moved to the front when the modifier is released.
+struct MruCycle {
+    bool active = false;
+    xcb_window_t position = XCB_WINDOW_NONE;
+    uint16_t modifiers = 0;
+    std::vector<xcb_keycode_t> release_keys; // keycodes bound to modifiers, from the server's mapping
+} mru_cycle;
+
+// Snapshot for bars and pagers in POSIX shared memory, see swm_state.h.
+swm_state* state_export = nullptr;
+bool state_export_dirty = true;
+
+// Set when the focused window went away. The replacement is picked once at the
+// end of the event batch, so a burst of DestroyNotify focuses a single window.
+bool focus_fallback_pending = false;
+
+// Scratchpad windows stay mapped at all times and are only moved between an
+// offscreen parking spot and their visible geometry, so toggling one is a
+// single ConfigureWindow and never touches the tiling of any workspace.
+struct Scratchpad {
+    const char* name;
+    const char* command;
+    xcb_window_t window = XCB_WINDOW_NONE;
+    bool visible = false;
+    pid_t spawned_pid = 0; // the command's process, until its window shows up
+    std::chrono::steady_clock::time_point spawned_at{};
+};
+std::array<Scratchpad, 2> scratchpads = {{
+    {"term", "st"},
+    {"notes", nullptr},
+}};
+// How long a spawned scratchpad command has to map its window.
+constexpr auto SCRATCHPAD_CLAIM_TIMEOUT = std::chrono::seconds(10);
+
+std::string_view trim(std::string_view text) {
+    while (!text.empty() && isspace((unsigned char)text.front())) text.remove_prefix(1);
+    while (!text.empty() && isspace((unsigned char)text.back())) text.remove_suffix(1);
+    return text;
+}
+
+// Splits off the first whitespace-separated word of text.
+std::string_view next_word(std::string_view& text) {
+    text = trim(text);
+    size_t end = 0;
+    while (end < text.size() && !isspace((unsigned char)text[end])) ++end;
+    std::string_view word = text.substr(0, end);
+    text = trim(text.substr(end));
+    return word;
+}
+
+bool parse_keycode(std::string_view name, xcb_keycode_t* keycode) {
+    // Keycodes of a US layout; anything else can be given as a raw keycode.
+    static const std::pair<std::string_view, xcb_keycode_t> key_names[] = {
+        {"Return", KEYCODE_RETURN}, {"Escape", KEYCODE_ESCAPE}, {"space", KEYCODE_SPACE}, {"Tab", KEYCODE_TAB},
+        {"BackSpace", KEYCODE_BACKSPACE},
+        {"grave", KEYCODE_GRAVE}, {"plus", KEYCODE_PLUS}, {"minus", KEYCODE_MINUS},
+        {"1", KEYCODE_1}, {"2", KEYCODE_2}, {"3", KEYCODE_3}, {"4", KEYCODE_4}, {"5", KEYCODE_5},
+        {"6", KEYCODE_6}, {"7", KEYCODE_7}, {"8", KEYCODE_8}, {"9", KEYCODE_9}, {"0", KEYCODE_0},
+        {"q", KEYCODE_Q}, {"w", KEYCODE_W}, {"e", 26}, {"r", 27}, {"t", 28}, {"y", 29}, {"u", 30},
+        {"i", 31}, {"o", 32}, {"p", 33}, {"a", 38}, {"s", 39}, {"d", KEYCODE_D}, {"f", KEYCODE_F},
+        {"g", 42}, {"h", KEYCODE_H}, {"j", KEYCODE_J}, {"k", KEYCODE_K}, {"l", KEYCODE_L},
+        {"z", 52}, {"x", 53}, {"c", 54}, {"v", 55}, {"b", 56}, {"n", KEYCODE_N}, {"m", 58},
+    };
+    for (const auto& [key_name, code] : key_names) {
+        if (key_name == name) {
+            *keycode = code;
+            return true;
+        }
+    }
+    unsigned value = 0;
+    auto [end, error] = std::from_chars(name.data(), name.data() + name.size(), value);
+    if (error != std::errc() || end != name.data() + name.size() || value < 8 || value > 255) return false;
+    *keycode = value;
+    return true;
+}
+
+bool parse_binding(std::string_view text, KeyBinding* binding) {
+    static const std::pair<std::string_view, Action> action_names[] = {
+        {"spawn", Action::Spawn}, {"quit", Action::Quit}, {"kill", Action::Kill},
+        {"floating", Action::ToggleFloating}, {"fullscreen", Action::ToggleFullscreen},
+        {"focus_next", Action::FocusNext}, {"focus_prev", Action::FocusPrev},
+        {"move_down", Action::MoveDown}, {"move_up", Action::MoveUp},
+        {"gap_increase", Action::GapIncrease}, {"gap_decrease", Action::GapDecrease},
+        {"ratio_decrease", Action::RatioDecrease}, {"ratio_increase", Action::RatioIncrease},
+        {"workspace", Action::Workspace}, {"move_to_workspace", Action::MoveToWorkspace},
+        {"scratchpad", Action::ToggleScratchpad}, {"scratchpad_assign", Action::AssignScratchpad},
+        {"focus_last", Action::FocusLast}, {"focus_cycle", Action::FocusCycle},
+        {"focus_cycle_back", Action::FocusCycleBack},
+        {"workspace_next", Action::WorkspaceNext}, {"workspace_prev", Action::WorkspacePrev},
+        {"workspace_new", Action::WorkspaceNew},
+    };
+
+    // Combination: modifiers and a key joined by '+', e.g. super+shift+Return.
+    std::string_view combination = next_word(text);
+    while (true) {
+        size_t plus = combination.find('+');
+        // A trailing "+plus" or a lone "plus" names the key itself.
+        if (plus == std::string_view::npos || plus == combination.size() - 1) break;
+        std::string_view modifier = combination.substr(0, plus);
+        if (modifier == "super" || modifier == "mod4") binding->modifiers |= XCB_MOD_MASK_4;
+        else if (modifier == "shift") binding->modifiers |= XCB_MOD_MASK_SHIFT;
+        else if (modifier == "ctrl" || modifier == "control") binding->modifiers |= XCB_MOD_MASK_CONTROL;
+        else if (modifier == "alt" || modifier == "mod1") binding->modifiers |= XCB_MOD_MASK_1;
+        else return false;
+        combination.remove_prefix(plus + 1);
+    }
+    if (!parse_keycode(combination, &binding->keycode)) return false;
+
+    std::string_view action = next_word(text);
+    auto found = std::find_if(std::begin(action_names), std::end(action_names),
+                              [&](const auto& entry) { return entry.first == action; });
+    if (found == std::end(action_names)) return false;
+    binding->action = found->second;
+
+    switch (binding->action) {
+        case Action::Spawn:
+            binding->command = std::string(text);
+            return !binding->command.empty();
+        case Action::Workspace:
+        case Action::MoveToWorkspace: {
+            auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), binding->argument);
+            binding->argument -= 1;
+            return error == std::errc() && end == text.data() + text.size() &&
+                   binding->argument >= 0 && binding->argument < WORKSPACE_LIMIT;
+        }
+        case Action::ToggleScratchpad:
+        case Action::AssignScratchpad:
+            for (size_t i = 0; i < scratchpads.size(); ++i) {
+                if (text == scratchpads[i].name) {
+                    binding->argument = i;
+                    return true;
+                }
+            }
+            return false;
+        default:
+            return text.empty();
+    }
+}
+
+// "<class> <mode>"; the class can't contain whitespace.
+bool parse_drag_rule(std::string_view text, std::pair<std::string, DragMode>* rule) {
+    std::string_view wm_class = next_word(text);
+    std::string_view mode = trim(text);
+    if (wm_class.empty()) return false;
+    rule->first = std::string(wm_class);
+    if (mode == "live") rule->second = DragMode::Live;
+    else if (mode == "wireframe") rule->second = DragMode::Wireframe;
+    else if (mode == "paced") rule->second = DragMode::Paced;
+    else return false;
+    return true;
+}
+
+bool parse_freeze_rule(std::string_view text, std::pair<std::string, FreezePolicy>* rule) {
+    std::string_view wm_class = next_word(text);
+    std::string_view policy = trim(text);
+    if (wm_class.empty()) return false;
+    rule->first = std::string(wm_class);
+    if (policy == "none") rule->second = FreezePolicy::None;
+    else if (policy == "stop") rule->second = FreezePolicy::Stop;
+    else if (policy == "cgroup") rule->second = FreezePolicy::Cgroup;
+    else return false;
+    return true;
+}
+
+bool parse_color(std::string_view text, Rgb* color) {
+    if (text.size() != 7 || text[0] != '#') return false;
+    unsigned value = 0;
+    auto [end, error] = std::from_chars(text.data() + 1, text.data() + text.size(), value, 16);
+    if (error != std::errc() || end != text.data() + text.size()) return false;
+    // Scale 8-bit channels to the 16-bit range of AllocColor.
+    color->red = ((value >> 16) & 0xFF) * 257;
+    color->green = ((value >> 8) & 0xFF) * 257;
+    color->blue = (value & 0xFF) * 257;
+    return true;
+}
+
+// Single pass over "key = value" lines; '#' starts a comment. Returns nullptr
+// and reports the line on the first error, so a broken edit never replaces a
+// working configuration.
+std::shared_ptr<const Config> parse_config(std::string_view text, const char* source) {
+    auto parsed = std::make_shared<Config>();
+    int line_number = 0;
+    while (!text.empty()) {
+        size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+        ++line_number;
+
+        line = trim(line);
+        if (line.empty() || line.front() == '#') continue;
+        size_t equals = line.find('=');
+        if (equals == std::string_view::npos) {
+            std::cerr << source << ":" << line_number << ": expected key = value" << std::endl;
+            return nullptr;
+        }
+        std::string_view key = trim(line.substr(0, equals));
+        std::string_view value = trim(line.substr(equals + 1));
+
+        bool ok = false;
+        if (key == "gap_size") {
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parsed->gap_size);
+            ok = error == std::errc() && end == value.data() + value.size() && parsed->gap_size >= 0;
+        } else if (key == "master_ratio") {
+            auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parsed->master_ratio);
+            ok = error == std::errc() && end == value.data() + value.size() &&
+                 parsed->master_ratio >= 0.1f && parsed->master_ratio <= 0.9f;
+        } else if (key == "focused_border") {
+            ok = parse_color(value, &parsed->focused_border);
+        } else if (key == "unfocused_border") {
+            ok = parse_color(value, &parsed->unfocused_border);
+        } else if (key == "focus_follows_mouse") {
+            ok = value == "true" || value == "false";
+            parsed->focus_follows_mouse = value == "true";
+        } else if (key == "bind") {
+            KeyBinding binding;
+            ok = parse_binding(value, &binding);
+            if (ok) parsed->bindings.push_back(std::move(binding));
+        } else if (key == "drag") {
+            std::pair<std::string, DragMode> rule;
+            ok = parse_drag_rule(value, &rule);
+            if (ok) parsed->drag_rules.push_back(std::move(rule));
+        } else if (key == "freeze") {
+            std::pair<std::string, FreezePolicy> rule;
+            ok = parse_freeze_rule(value, &rule);
+            if (ok) parsed->freeze_rules.push_back(std::move(rule));
+        }
+        if (!ok) {
+            std::cerr << source << ":" << line_number << ": invalid " << key << " '" << value << "'" << std::endl;
+            return nullptr;
+        }
+    }
+    return parsed;
+}
+
+std::shared_ptr<const Config> default_config() {
+    return parse_config(DEFAULT_BINDINGS, "default bindings");
+}
+
+// Parses the config file if there is one. Files without bind lines keep the
+// default bindings.
+std::shared_ptr<const Config> load_config() {
+    std::shared_ptr<const Config> loaded;
+    int fd = open(config_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat file_stat{};
+    if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        void* mapped = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            loaded = parse_config(std::string_view((const char*)mapped, file_stat.st_size), config_path.c_str());
+            munmap(mapped, file_stat.st_size);
+        }
+    } else {
+        loaded = default_config();
+    }
+    if (fd >= 0) close(fd);
+    if (loaded && loaded->bindings.empty()) {
+        auto with_defaults = std::make_shared<Config>(*loaded);
+        with_defaults->bindings = default_config()->bindings;
+        loaded = with_defaults;
+    }
+    return loaded;
+}
 
 xcb_atom_t get_atom(xcb_connection_t* conn, const char* name) {
     xcb_intern_atom_cookie_t cookie = xcb_intern_atom(conn, 0, strlen(name), name);
@@ -86,204 +848,1044 @@ xcb_atom_t get_atom(xcb_connection_t* conn, const char* name) {
     return atom;
 }
 
-std::vector<xcb_window_t>& get_current_windows() {
-    return workspaces[current_workspace].windows;
+void track_request(xcb_void_cookie_t cookie, xcb_window_t window) {
+    tracked_requests[cookie.sequence % TRACKED_REQUESTS] = { cookie.sequence, window };
 }
 
-xcb_window_t& get_current_focused() {
-    return workspaces[current_workspace].focused_window;
+void init_sync_extension(xcb_connection_t* conn) {
+    const xcb_query_extension_reply_t* extension = xcb_get_extension_data(conn, &xcb_sync_id);
+    if (!extension || !extension->present) {
+        std::cerr << "XSync is not available; not waiting for _NET_WM_SYNC_REQUEST" << std::endl;
+        return;
+    }
+    xcb_sync_initialize_reply_t* reply = xcb_sync_initialize_reply(conn, xcb_sync_initialize(conn, 3, 1), nullptr);
+    if (!reply) return;
+    free(reply);
+    sync_extension.present = true;
+    sync_extension.first_event = extension->first_event;
 }
 
-void hide_workspace_windows(xcb_connection_t* conn, int workspace_id) {
-    for (xcb_window_t window : workspaces[workspace_id].windows) {
-        xcb_unmap_window(conn, window);
+// One alarm per client, re-armed with the awaited value on every request.
+void setup_client_sync(xcb_connection_t* conn, xcb_window_t window, ClientSync& sync) {
+    if (sync.counter == 0 || !sync_extension.present) {
+        sync.counter = 0;
+        return;
     }
-    xcb_flush(conn);
+    sync.alarm = xcb_generate_id(conn);
+    uint32_t values[] = {
+        sync.counter,
+        XCB_SYNC_VALUETYPE_ABSOLUTE,
+        0, 0, // value, high and low word
+        XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON,
+        0, 0, // delta
+        1 // events
+    };
+    track_request(xcb_sync_create_alarm(conn, sync.alarm,
+        XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE | XCB_SYNC_CA_TEST_TYPE |
+        XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS, values), window);
+    // Read when the first request goes out, by which time the reply is in.
+    sync.initial_value = xcb_sync_query_counter(conn, sync.counter);
+    sync_alarms[sync.alarm] = window;
 }
 
-void show_workspace_windows(xcb_connection_t* conn, int workspace_id) {
-    for (xcb_window_t window : workspaces[workspace_id].windows) {
-        xcb_map_window(conn, window);
+void release_client_sync(xcb_connection_t* conn, ClientSync& sync) {
+    if (sync.counter == 0) return;
+    if (!sync.value_known) {
+        xcb_discard_reply(conn, sync.initial_value.sequence);
     }
-    xcb_flush(conn);
+    sync_alarms.erase(sync.alarm);
+    xcb_sync_destroy_alarm(conn, sync.alarm);
 }
 
-bool is_floating(xcb_window_t window) {
-    return std::find(floating_windows.begin(), floating_windows.end(), window) != floating_windows.end();
+void arm_sync_timer() {
+    itimerspec spec{};
+    if (!sync_waiting.empty()) {
+        auto client = clients.find(sync_waiting.front());
+        auto deadline = client->second.sync.requested_at + std::chrono::milliseconds(sync_timeout_ms);
+        auto remaining = std::max<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now(), std::chrono::microseconds(1));
+        spec.it_value.tv_sec = remaining.count() / 1000000000;
+        spec.it_value.tv_nsec = remaining.count() % 1000000000;
+    }
+    timerfd_settime(sync_timer_fd, 0, &spec, nullptr);
 }
 
-void spawn(const char* command) {
-    if (fork() == 0) {
-        setsid();
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
-        execlp(command, command, NULL);
-        _exit(127);
+void request_sync(xcb_connection_t* conn, xcb_window_t window, ClientSync& sync) {
+    if (!sync.value_known) {
+        if (xcb_sync_query_counter_reply_t* reply = xcb_sync_query_counter_reply(conn, sync.initial_value, nullptr)) {
+            sync.value = ((int64_t)reply->counter_value.hi << 32) | reply->counter_value.lo;
+            free(reply);
+        }
+        sync.value_known = true;
     }
+    ++sync.value;
+    xcb_client_message_event_t message{};
+    message.response_type = XCB_CLIENT_MESSAGE;
+    message.format = 32;
+    message.window = window;
+    message.type = swm_atoms.WM_PROTOCOLS;
+    message.data.data32[0] = ewmh._NET_WM_SYNC_REQUEST;
+    message.data.data32[1] = XCB_CURRENT_TIME;
+    message.data.data32[2] = (uint32_t)sync.value;
+    message.data.data32[3] = (uint32_t)(sync.value >> 32);
+    track_request(xcb_send_event(conn, 0, window, XCB_EVENT_MASK_NO_EVENT, (const char*)&message), window);
+    uint32_t trigger[] = { (uint32_t)(sync.value >> 32), (uint32_t)sync.value };
+    track_request(xcb_sync_change_alarm(conn, sync.alarm, XCB_SYNC_CA_VALUE, trigger), window);
+    sync.waiting = true;
+    sync.requested_at = std::chrono::steady_clock::now();
+    sync_waiting.push_back(window);
+    if (sync_waiting.size() == 1) arm_sync_timer();
 }
 
-void focus_client(xcb_connection_t* conn, xcb_window_t window_id) {
-    static xcb_window_t last_focused = XCB_WINDOW_NONE;
-    if (focused_client_window == window_id) return;
+// Every layout and drag change of a managed client's geometry goes through
+// here. A client that supports _NET_WM_SYNC_REQUEST has at most one resize in
+// flight: until it has drawn the previous size, newer geometry only replaces
+// what is pending, so a slow client never builds up a backlog of configures.
+void configure_client(xcb_connection_t* conn, xcb_window_t window, uint16_t mask, const uint32_t* values) {
+    constexpr uint16_t geometry_mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+                                       XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_BORDER_WIDTH;
+    auto client = clients.find(window);
+    if (client == clients.end() || client->second.sync.counter == 0 || (mask & ~geometry_mask)) {
+        track_request(xcb_configure_window(conn, window, mask, values), window);
+        return;
+    }
+    ClientSync& sync = client->second.sync;
+    int next = 0;
+    for (int slot = 0; slot < 5; ++slot) {
+        if (mask & (1 << slot)) sync.pending[slot] = values[next++];
+    }
+    sync.pending_mask |= mask;
+    if (sync.waiting) return;
 
-    if (last_focused != XCB_WINDOW_NONE && last_focused != window_id) {
-        std::cout << "  Changing border of previous focused window " << last_focused << " to unfocused color." << std::endl;
-        xcb_change_window_attributes(conn, last_focused, XCB_CW_BORDER_PIXEL, &unfocused_border);
+    uint32_t merged[5];
+    int count = 0;
+    for (int slot = 0; slot < 5; ++slot) {
+        if (sync.pending_mask & (1 << slot)) merged[count++] = sync.pending[slot];
     }
+    uint16_t merged_mask = sync.pending_mask;
+    sync.pending_mask = 0;
+    bool resized = ((merged_mask & XCB_CONFIG_WINDOW_WIDTH) && sync.pending[2] != sync.width) ||
+                   ((merged_mask & XCB_CONFIG_WINDOW_HEIGHT) && sync.pending[3] != sync.height);
+    if (merged_mask & XCB_CONFIG_WINDOW_WIDTH) sync.width = sync.pending[2];
+    if (merged_mask & XCB_CONFIG_WINDOW_HEIGHT) sync.height = sync.pending[3];
+    // Moves don't make the client redraw, so only resizes wait for it.
+    if (resized) request_sync(conn, window, sync);
+    track_request(xcb_configure_window(conn, window, merged_mask, merged), window);
+}
 
-    if (window_id != XCB_WINDOW_NONE) {
-        xcb_change_window_attributes(conn, window_id, XCB_CW_BORDER_PIXEL, &focused_border);
-        last_focused = window_id;
-        std::cout << "Focusing client " << window_id << std::endl;
-        get_current_focused() = window_id;
-        focused_client_window = window_id;
-        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, window_id, XCB_CURRENT_TIME);
-        xcb_circulate_window(conn, XCB_CIRCULATE_RAISE_LOWEST, window_id);
-        xcb_change_property(
-            conn,
-            XCB_PROP_MODE_REPLACE,
-            screen->root,
-            ewmh._NET_ACTIVE_WINDOW,
-            XCB_ATOM_WINDOW,
-            32,
-            1,
-            &window_id);
+void finish_sync_wait(xcb_connection_t* conn, xcb_window_t window, bool timed_out) {
+    auto client = clients.find(window);
+    if (client == clients.end() || !client->second.sync.waiting) return;
+    ClientSync& sync = client->second.sync;
+    sync.waiting = false;
+    std::erase(sync_waiting, window);
+    double latency_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sync.requested_at).count();
+    if (timed_out) {
+        ++sync.timeouts;
+        std::cout << "Window " << window << " (" << client->second.wm_class << ") did not redraw within "
+                  << sync_timeout_ms << "ms" << std::endl;
     } else {
-        focused_client_window = XCB_WINDOW_NONE;
-        xcb_change_property(
-            conn,
-            XCB_PROP_MODE_REPLACE,
-            screen->root,
-            ewmh._NET_ACTIVE_WINDOW,
-            XCB_ATOM_WINDOW,
-            32,
-            1,
-            &window_id // window_id to XCB_WINDOW_NONE
-        );
+        ++sync.acks;
+        sync.total_latency_ms += latency_ms;
+        sync.max_latency_ms = std::max(sync.max_latency_ms, latency_ms);
+    }
+    if (sync.pending_mask) {
+        configure_client(conn, window, 0, nullptr);
     }
+}
 
-    xcb_flush(conn);
+void handle_sync_alarm(xcb_connection_t* conn, const xcb_sync_alarm_notify_event_t* notify) {
+    auto alarm = sync_alarms.find(notify->alarm);
+    if (alarm == sync_alarms.end()) return;
+    xcb_window_t window = alarm->second;
+    int64_t value = ((int64_t)notify->counter_value.hi << 32) | notify->counter_value.lo;
+    auto client = clients.find(window);
+    if (client != clients.end() && client->second.sync.waiting && value >= client->second.sync.value) {
+        finish_sync_wait(conn, window, false);
+        arm_sync_timer();
+    }
 }
 
-void kill_client(xcb_connection_t* conn, xcb_window_t window_id) {
-    if (window_id == XCB_WINDOW_NONE) {
-        std::cerr << "kill_client called with XCB_WINDOW_NONE. Aborting." << std::endl;
-        return;
+void handle_sync_timer(xcb_connection_t* conn) {
+    uint64_t expirations;
+    if (read(sync_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    auto now = std::chrono::steady_clock::now();
+    std::vector<xcb_window_t> expired;
+    for (xcb_window_t window : sync_waiting) {
+        if (clients[window].sync.requested_at + std::chrono::milliseconds(sync_timeout_ms) <= now) {
+            expired.push_back(window);
+        }
     }
-    std::cout << "Attempting to kill " << window_id << std::endl;
-    xcb_intern_atom_cookie_t wm_delete_window_cookie = xcb_intern_atom(conn, 0, strlen("WM_DELETE_WINDOW"), "WM_DELETE_WINDOW");
-    xcb_intern_atom_reply_t* wm_delete_window_reply = xcb_intern_atom_reply(conn, wm_delete_window_cookie, nullptr);
-    xcb_intern_atom_cookie_t wm_protocols_cookie = xcb_intern_atom(conn, 0, strlen("WM_PROTOCOLS"), "WM_PROTOCOLS");
-    xcb_intern_atom_reply_t* wm_protocols_reply = xcb_intern_atom_reply(conn, wm_protocols_cookie, nullptr);
-    if (wm_delete_window_reply && wm_protocols_reply) {
-        xcb_client_message_event_t event;
-        event.response_type = XCB_CLIENT_MESSAGE;
-        event.format = 32;
-        event.sequence = 0;
-        event.window = window_id;
-        event.type = wm_protocols_reply -> atom;
-        event.data.data32[0] = wm_delete_window_reply -> atom;
-        event.data.data32[1] = XCB_CURRENT_TIME;
-        xcb_send_event(conn, 0, window_id, XCB_EVENT_MASK_NO_EVENT, (const char*)&event);
-        xcb_flush(conn);
+    for (xcb_window_t window : expired) {
+        finish_sync_wait(conn, window, true);
     }
-    else {
-        std::cerr << "Could not send WM_DELETE_WINDOW, forcefully killing client." << std::endl;
-        xcb_kill_client(conn, window_id);
-        xcb_flush(conn);
+    arm_sync_timer();
+}
+
+void read_wm_class(xcb_connection_t* conn, xcb_get_property_cookie_t cookie, Client& client) {
+    xcb_get_property_reply_t* reply = xcb_get_property_reply(conn, cookie, nullptr);
+    if (!reply) return;
+    // WM_CLASS is two consecutive NUL-terminated strings: instance, then class.
+    const char* value = (const char*)xcb_get_property_value(reply);
+    int length = xcb_get_property_value_length(reply);
+    const char* separator = (const char*)memchr(value, '\0', length);
+    if (separator) {
+        client.wm_instance = InternedString(std::string_view(value, separator - value));
+        const char* class_start = separator + 1;
+        int class_length = length - (int)(class_start - value);
+        client.wm_class = InternedString(std::string_view(class_start, strnlen(class_start, std::max(class_length, 0))));
+    } else {
+        client.wm_instance = InternedString(std::string_view(value, length));
     }
-    free(wm_delete_window_reply);
-    free(wm_protocols_reply);
+    free(reply);
 }
 
-void ungrab_key_with_mods(xcb_connection_t* conn, xcb_window_t root, xcb_keycode_t keycode, uint16_t modifiers) {
-    uint16_t num_lock_mask = XCB_MOD_MASK_2;
-    uint16_t caps_lock_mask = XCB_MOD_MASK_LOCK;
-    xcb_ungrab_key(conn, keycode, modifiers, root);
-    xcb_ungrab_key(conn, keycode, modifiers | caps_lock_mask, root);
-    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask, root);
-    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask | caps_lock_mask, root);
-    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask | caps_lock_mask, root);
+std::vector<xcb_window_t>& get_current_windows() {
+    return workspaces[current_workspace].windows;
 }
 
-uint32_t get_color_pixel(xcb_connection_t* conn, xcb_screen_t* screen, uint16_t red, uint16_t green, uint16_t blue) {
-    xcb_alloc_color_cookie_t color_cookie = xcb_alloc_color(conn, screen->default_colormap, red, green, blue);
-    xcb_alloc_color_reply_t* color_reply = xcb_alloc_color_reply(conn, color_cookie, NULL);
-    if (!color_reply) return screen->black_pixel;
-    uint32_t pixel = color_reply->pixel;
-    free(color_reply);
-    return pixel;
+xcb_window_t& get_current_focused() {
+    return workspaces[current_workspace].focused_window;
 }
 
-void apply_master_stack(xcb_connection_t* connection, xcb_screen_t* screen) {
-    auto& current_windows = get_current_windows();
-    std::vector<xcb_window_t> tilling_windows;
-    for (xcb_window_t window : current_windows) {
-        if (!is_floating(window)) {
-            tilling_windows.push_back(window);
-        }
+Workspaces& workspace_at(int workspace_id) {
+    auto [it, created] = workspaces.try_emplace(workspace_id);
+    if (created) desktops_dirty = true;
+    return it->second;
+}
+
+// Frees a workspace once nothing is left on it, unless it is being shown.
+void release_workspace_if_empty(int workspace_id) {
+    if (workspace_id == current_workspace) return;
+    auto it = workspaces.find(workspace_id);
+    if (it == workspaces.end() || !it->second.windows.empty()) return;
+    workspaces.erase(it);
+    desktops_dirty = true;
+}
+
+// EWMH desktops are numbered contiguously, so pagers see up to the highest id in use.
+uint32_t desktop_count() {
+    return workspaces.empty() ? 1 : workspaces.rbegin()->first + 1;
+}
+
+void mru_unlink(xcb_window_t window) {
+    auto it = clients.find(window);
+    if (it == clients.end() || it->second.workspace < 0) return;
+    Client& client = it->second;
+    Workspaces& workspace = workspaces[client.workspace];
+    if (client.mru_prev != XCB_WINDOW_NONE) {
+        clients[client.mru_prev].mru_next = client.mru_next;
+    } else {
+        workspace.mru_head = client.mru_next;
+    }
+    if (client.mru_next != XCB_WINDOW_NONE) {
+        clients[client.mru_next].mru_prev = client.mru_prev;
+    } else {
+        workspace.mru_tail = client.mru_prev;
+    }
+    client.mru_prev = XCB_WINDOW_NONE;
+    client.mru_next = XCB_WINDOW_NONE;
+    client.workspace = -1;
+    if (mru_cycle.position == window) {
+        mru_cycle.position = XCB_WINDOW_NONE;
     }
+}
 
-    if (!tilling_windows.empty()) {
-        if (tilling_windows.size() == 1) {
-            uint32_t fullscreen_geom[4] = {
-                gap_size, // x
-                gap_size, // y
-                (uint32_t)(screen->width_in_pixels - 2 * gap_size),
-                (uint32_t)(screen->height_in_pixels - 2 * gap_size)
-            };
-            xcb_configure_window(connection, tilling_windows[0], XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, fullscreen_geom);
-        } else {
-            xcb_window_t master = tilling_windows[0];
-            int usable_width = screen->width_in_pixels - 2 * gap_size;
-            int usable_height = screen->height_in_pixels - 2 * gap_size;
-            int master_width = (usable_width * master_ratio) - (gap_size / 2);
-            int stack_width = usable_width - master_width - gap_size;
-            int stack_count = tilling_windows.size() - 1;
+// Links a window into a workspace's list, at the front when it was just used
+// and at the back when it merely arrived there.
+void mru_link(xcb_window_t window, int workspace_id, bool front) {
+    auto it = clients.find(window);
+    if (it == clients.end()) return;
+    mru_unlink(window);
+    Client& client = it->second;
+    Workspaces& workspace = workspaces[workspace_id];
+    client.workspace = workspace_id;
+    if (front) {
+        client.mru_next = workspace.mru_head;
+        if (workspace.mru_head != XCB_WINDOW_NONE) clients[workspace.mru_head].mru_prev = window;
+        workspace.mru_head = window;
+        if (workspace.mru_tail == XCB_WINDOW_NONE) workspace.mru_tail = window;
+    } else {
+        client.mru_prev = workspace.mru_tail;
+        if (workspace.mru_tail != XCB_WINDOW_NONE) clients[workspace.mru_tail].mru_next = window;
+        workspace.mru_tail = window;
+        if (workspace.mru_head == XCB_WINDOW_NONE) workspace.mru_head = window;
+    }
+}
 
-            uint32_t master_geom[4] = {
-                gap_size,
-                gap_size,
-                (uint32_t)master_width,
-                (uint32_t)usable_height
-            };
-            xcb_configure_window(connection, master,
-                XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
-                master_geom);
+// Moves a window to the front of the list it is already on.
+void mru_touch(xcb_window_t window) {
+    auto it = clients.find(window);
+    if (it == clients.end() || it->second.workspace < 0) return;
+    if (workspaces[it->second.workspace].mru_head == window) return;
+    mru_link(window, it->second.workspace, true);
+}
 
-            for (size_t i = 1; i < tilling_windows.size(); ++i) {
-                int stack_height_per_window = (usable_height - (stack_count - 1) * gap_size) / stack_count;
-                int stack_y = gap_size + (i-1) * (stack_height_per_window + gap_size);
-                uint32_t stack_geom[4] = {
-                    gap_size + master_width + gap_size,
-                    (uint32_t)stack_y,
-                    (uint32_t)stack_width,
-                    (uint32_t)stack_height_per_window
-                };
-                xcb_configure_window(connection, tilling_windows[i],
-                    XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
-                    stack_geom);
+xcb_window_t mru_step(xcb_window_t from, bool forward) {
+    const Workspaces& workspace = workspaces[current_workspace];
+    auto it = clients.find(from);
+    if (from == XCB_WINDOW_NONE || it == clients.end() || it->second.workspace != current_workspace) {
+        return forward ? workspace.mru_head : workspace.mru_tail;
+    }
+    xcb_window_t next = forward ? it->second.mru_next : it->second.mru_prev;
+    if (next == XCB_WINDOW_NONE) next = forward ? workspace.mru_head : workspace.mru_tail;
+    return next;
+}
 
-            }
+void publish_wm_state(xcb_connection_t* conn, xcb_window_t window, const Client& client) {
+    xcb_atom_t states[2];
+    uint32_t count = 0;
+    if (client.hidden) states[count++] = ewmh._NET_WM_STATE_HIDDEN;
+    if (client.fullscreen) states[count++] = ewmh._NET_WM_STATE_FULLSCREEN;
+    track_request(xcb_change_property(conn, XCB_PROP_MODE_REPLACE, window, ewmh._NET_WM_STATE, XCB_ATOM_ATOM, 32, count, states), window);
+}
+
+void set_client_hidden(xcb_connection_t* conn, xcb_window_t window, bool hidden) {
+    auto client = clients.find(window);
+    if (client == clients.end() || client->second.hidden == hidden) return;
+    client->second.hidden = hidden;
+    publish_wm_state(conn, window, client->second);
+    state_export_dirty = true;
+}
+
+void read_client_pid(xcb_connection_t* conn, xcb_get_property_cookie_t pid_cookie,
+                     xcb_get_property_cookie_t machine_cookie, Client& client) {
+    xcb_get_property_reply_t* pid_reply = xcb_get_property_reply(conn, pid_cookie, nullptr);
+    xcb_get_property_reply_t* machine_reply = xcb_get_property_reply(conn, machine_cookie, nullptr);
+    if (pid_reply && xcb_get_property_value_length(pid_reply) >= 4) {
+        client.pid = *(uint32_t*)xcb_get_property_value(pid_reply);
+    }
+    // _NET_WM_PID is only meaningful on the host that set it.
+    if (machine_reply && xcb_get_property_value_length(machine_reply) > 0) {
+        char hostname[256] = {};
+        gethostname(hostname, sizeof(hostname) - 1);
+        std::string machine((const char*)xcb_get_property_value(machine_reply), xcb_get_property_value_length(machine_reply));
+        if (machine != hostname) {
+            client.pid = 0;
         }
     }
+    free(pid_reply);
+    free(machine_reply);
+}
 
-    for (xcb_window_t floating_window : floating_windows) {
-        uint32_t values[] = { XCB_STACK_MODE_ABOVE };
-        xcb_configure_window(connection, floating_window, XCB_CONFIG_WINDOW_STACK_MODE, values);
+FreezePolicy freeze_policy_for(const Client& client) {
+    if (client.pid <= 0) return FreezePolicy::None;
+    for (const auto& [wm_class, policy] : config->freeze_rules) {
+        if (client.wm_class == wm_class) return policy;
     }
-    xcb_flush(connection);
+    return FreezePolicy::None;
 }
 
-void switch_workspace(xcb_connection_t* conn, xcb_screen_t* screen, int new_workspace) {
-    if (new_workspace == current_workspace || new_workspace < 0 || new_workspace >= MAX_WORKSPACES) {
+// utime + stime from /proc/<pid>/stat, in clock ticks. Also returns the
+// process start time (ticks after boot) through start_ticks when asked.
+bool read_process_cpu_ticks(pid_t pid, uint64_t* cpu_ticks, uint64_t* start_ticks = nullptr) {
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!std::getline(stat_file, stat)) return false;
+    // The command name can contain spaces, fields are counted from its closing paren.
+    size_t paren = stat.rfind(')');
+    if (paren == std::string::npos) return false;
+    std::vector<std::string> fields;
+    for (auto field : std::views::split(std::string_view(stat).substr(paren + 2), ' ')) {
+        fields.emplace_back(field.begin(), field.end());
+    }
+    // fields[0] is field 3 (state) of proc(5).
+    if (fields.size() < 20) return false;
+    *cpu_ticks = std::stoull(fields[11]) + std::stoull(fields[12]);
+    if (start_ticks) *start_ticks = std::stoull(fields[19]);
+    return true;
+}
+
+bool write_cgroup_procs(const std::string& cgroup_dir, pid_t pid) {
+    std::ofstream procs(cgroup_dir + "/cgroup.procs");
+    procs << pid << std::endl;
+    return procs.good();
+}
+
+// Creates throttle_cgroup with the cpu controller enabled and the lowest
+// weight. Without the controller cpu.weight doesn't exist and moving a
+// process there would throttle nothing.
+bool prepare_throttle_cgroup() {
+    static bool prepared = false;
+    if (prepared) return true;
+    std::string cgroup_dir = throttle_cgroup;
+    std::string parent = cgroup_dir.substr(0, cgroup_dir.rfind('/'));
+    std::ofstream subtree_control(parent + "/cgroup.subtree_control");
+    subtree_control << "+cpu" << std::endl;
+    if (!subtree_control.good()) {
+        std::cerr << "Could not enable the cpu controller in " << parent << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (mkdir(throttle_cgroup, 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Could not create " << throttle_cgroup << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::ofstream weight(cgroup_dir + "/cpu.weight");
+    weight << 1 << std::endl;
+    if (!weight.good()) {
+        std::cerr << "Could not set cpu.weight in " << throttle_cgroup << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    prepared = true;
+    return true;
+}
+
+bool process_visible(pid_t pid) {
+    for (xcb_window_t window : get_current_windows()) {
+        auto client = clients.find(window);
+        if (client != clients.end() && client->second.pid == pid) return true;
+    }
+    // Parked scratchpads are still mapped and have to answer instantly.
+    for (const Scratchpad& scratchpad : scratchpads) {
+        auto client = clients.find(scratchpad.window);
+        if (client != clients.end() && client->second.pid == pid) return true;
+    }
+    return false;
+}
+
+void freeze_client_process(const Client& client, int workspace_id) {
+    FreezePolicy policy = freeze_policy_for(client);
+    if (policy == FreezePolicy::None || frozen_processes.contains(client.pid) || process_visible(client.pid)) return;
+
+    FrozenProcess frozen;
+    frozen.policy = policy;
+    frozen.workspace = workspace_id;
+    frozen.frozen_at = std::chrono::steady_clock::now();
+    uint64_t start_ticks = 0;
+    if (!read_process_cpu_ticks(client.pid, &frozen.cpu_ticks_at_freeze, &start_ticks)) return;
+    double uptime_seconds = 0;
+    std::ifstream("/proc/uptime") >> uptime_seconds;
+    double ticks_per_second = sysconf(_SC_CLK_TCK);
+    double lifetime_seconds = uptime_seconds - start_ticks / ticks_per_second;
+    if (lifetime_seconds > 0) {
+        frozen.lifetime_ticks_per_second = frozen.cpu_ticks_at_freeze / lifetime_seconds;
+    }
+
+    if (policy == FreezePolicy::Stop) {
+        if (kill(client.pid, SIGSTOP) != 0) {
+            std::cerr << "Could not stop process " << client.pid << ": " << strerror(errno) << std::endl;
+            return;
+        }
+    } else {
+        std::ifstream cgroup_file("/proc/" + std::to_string(client.pid) + "/cgroup");
+        std::string line;
+        while (std::getline(cgroup_file, line)) {
+            if (line.starts_with("0::")) frozen.original_cgroup = "/sys/fs/cgroup" + line.substr(3);
+        }
+        if (!prepare_throttle_cgroup()) return;
+        if (frozen.original_cgroup.empty() || !write_cgroup_procs(throttle_cgroup, client.pid)) {
+            std::cerr << "Could not move process " << client.pid << " into " << throttle_cgroup << std::endl;
+            return;
+        }
+    }
+    std::cout << "Froze process " << client.pid << " (" << client.wm_class << ") on workspace " << workspace_id + 1 << std::endl;
+    frozen_processes[client.pid] = std::move(frozen);
+    frozen_processes_dirty = true;
+}
+
+void thaw_process(pid_t pid) {
+    auto it = frozen_processes.find(pid);
+    if (it == frozen_processes.end()) return;
+    FrozenProcess& frozen = it->second;
+
+    uint64_t cpu_ticks_now = frozen.cpu_ticks_at_freeze;
+    read_process_cpu_ticks(pid, &cpu_ticks_now);
+    if (frozen.policy == FreezePolicy::Stop) {
+        kill(pid, SIGCONT);
+    } else {
+        write_cgroup_procs(frozen.original_cgroup, pid);
+    }
+
+    double ticks_per_second = sysconf(_SC_CLK_TCK);
+    double frozen_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - frozen.frozen_at).count();
+    double used_seconds = (cpu_ticks_now - frozen.cpu_ticks_at_freeze) / ticks_per_second;
+    double saved_seconds = std::max(0.0, frozen_seconds * frozen.lifetime_ticks_per_second / ticks_per_second - used_seconds);
+    std::cout << "Thawed process " << pid << " after " << frozen_seconds << "s, ~" << saved_seconds << "s CPU saved";
+    if (frozen.workspace >= 0) {
+        double& total = workspace_cpu_seconds_saved[frozen.workspace];
+        total += saved_seconds;
+        std::cout << " (workspace " << frozen.workspace + 1 << " total " << total << "s)";
+    }
+    std::cout << std::endl;
+    frozen_processes.erase(it);
+    frozen_processes_dirty = true;
+}
+
+void thaw_all_processes() {
+    while (!frozen_processes.empty()) {
+        thaw_process(frozen_processes.begin()->first);
+    }
+}
+
+// _SWM_FROZEN_PROCESSES on the root window lists the processes swm froze, one
+// "pid<TAB>original cgroup" line each (no cgroup for stopped processes). It
+// outlives swm, so an instance started after a crash can resume them.
+void publish_frozen_processes(xcb_connection_t* conn, xcb_screen_t* screen) {
+    if (!frozen_processes_dirty) return;
+    frozen_processes_dirty = false;
+    std::string list;
+    for (const auto& [pid, frozen] : frozen_processes) {
+        list += std::to_string(pid);
+        list += '\t';
+        if (frozen.policy == FreezePolicy::Cgroup) list += frozen.original_cgroup;
+        list += '\n';
+    }
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, swm_atoms._SWM_FROZEN_PROCESSES,
+                        swm_atoms.UTF8_STRING, 8, list.size(), list.data());
+}
+
+// Resumes what a previous instance froze and never thawed, e.g. because it
+// crashed. Processes that are still hidden get frozen again during adoption.
+void resume_orphaned_processes(xcb_connection_t* conn, xcb_screen_t* screen) {
+    xcb_get_property_reply_t* reply = xcb_get_property_reply(conn,
+        xcb_get_property(conn, 1, screen->root, swm_atoms._SWM_FROZEN_PROCESSES, swm_atoms.UTF8_STRING, 0, 1 << 16), nullptr);
+    if (!reply) return;
+    std::string_view list((const char*)xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+    int resumed = 0;
+    while (!list.empty()) {
+        size_t newline = list.find('\n');
+        std::string_view line = list.substr(0, newline);
+        list.remove_prefix(newline == std::string_view::npos ? list.size() : newline + 1);
+        size_t tab = line.find('\t');
+        pid_t pid = 0;
+        auto [end, error] = std::from_chars(line.data(), line.data() + line.size(), pid);
+        if (error != std::errc() || tab == std::string_view::npos || end != line.data() + tab || pid <= 0) continue;
+        std::string original_cgroup(line.substr(tab + 1));
+        if (original_cgroup.empty()) {
+            if (kill(pid, SIGCONT) == 0) ++resumed;
+        } else {
+            // Only move it back if it is still where swm put it; the pid may have been reused.
+            std::ifstream cgroup_file("/proc/" + std::to_string(pid) + "/cgroup");
+            std::string cgroup_line;
+            while (std::getline(cgroup_file, cgroup_line)) {
+                if (cgroup_line.starts_with("0::") && "/sys/fs/cgroup" + cgroup_line.substr(3) == throttle_cgroup &&
+                    write_cgroup_procs(original_cgroup, pid)) {
+                    ++resumed;
+                }
+            }
+        }
+    }
+    free(reply);
+    if (resumed > 0) {
+        std::cout << "Resumed " << resumed << " processes frozen by a previous instance" << std::endl;
+    }
+}
+
+void sample_process(pid_t pid, ProcessSample& sample, double interval_seconds) {
+    uint64_t cpu_ticks = 0;
+    if (!read_process_cpu_ticks(pid, &cpu_ticks)) return;
+    if (sample.seen && cpu_ticks >= sample.cpu_ticks) {
+        sample.cpu_percent = 100.0 * (cpu_ticks - sample.cpu_ticks) / sysconf(_SC_CLK_TCK) / interval_seconds;
+    }
+    sample.cpu_ticks = cpu_ticks;
+    sample.seen = true;
+    long size_pages = 0, resident_pages = 0;
+    std::ifstream("/proc/" + std::to_string(pid) + "/statm") >> size_pages >> resident_pages;
+    sample.rss_kb = resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void sample_client_resources() {
+    uint64_t expirations;
+    if (read(resource_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    double interval_seconds = resource_sample_interval_ms / 1000.0;
+
+    std::unordered_map<pid_t, ProcessSample> samples;
+    for (auto& [window, client] : clients) {
+        if (client.pid > 0 && !samples.contains(client.pid)) {
+            ProcessSample& sample = samples[client.pid];
+            if (auto previous = process_samples.find(client.pid); previous != process_samples.end()) {
+                sample = previous->second;
+            }
+            sample_process(client.pid, sample, interval_seconds);
+
+            // Thresholds are logged once when crossed and re-armed when the value drops back.
+            bool cpu_over = sample.cpu_percent > cpu_percent_threshold;
+            if (cpu_over && !sample.cpu_alert) {
+                std::cerr << "Process " << client.pid << " (" << client.wm_class << ") is using "
+                          << sample.cpu_percent << "% CPU" << std::endl;
+            }
+            sample.cpu_alert = cpu_over;
+            bool rss_over = sample.rss_kb > rss_threshold_kb;
+            if (rss_over && !sample.rss_alert) {
+                std::cerr << "Process " << client.pid << " (" << client.wm_class << ") has "
+                          << sample.rss_kb / 1024 << " MiB resident" << std::endl;
+            }
+            sample.rss_alert = rss_over;
+        }
+
+        uint32_t events = client.events.total() - client.events_at_last_sample;
+        client.events_at_last_sample = client.events.total();
+        bool events_over = events > events_per_sample_threshold;
+        if (events_over && !client.event_alert) {
+            std::cerr << "Window " << window << " (" << client.wm_class << ") generated " << events
+                      << " events in " << interval_seconds << "s" << std::endl;
+        }
+        client.event_alert = events_over;
+    }
+    // Processes without managed windows are dropped here.
+    process_samples = std::move(samples);
+}
+
+void print_client_row(int workspace_id, xcb_window_t window) {
+    auto it = clients.find(window);
+    if (it == clients.end()) return;
+    const Client& client = it->second;
+    std::cout << std::setw(4) << (workspace_id < 0 ? std::string("S") : std::to_string(workspace_id + 1))
+              << std::setw(12) << window
+              << std::setw(8) << client.pid;
+    if (auto sample = process_samples.find(client.pid); sample != process_samples.end()) {
+        std::cout << std::setw(8) << std::fixed << std::setprecision(1) << sample->second.cpu_percent
+                  << std::setw(10) << sample->second.rss_kb / 1024;
+    } else {
+        std::cout << std::setw(8) << "-" << std::setw(10) << "-";
+    }
+    std::cout << std::setw(8) << client.events.configure_requests
+              << std::setw(8) << client.events.focus_changes
+              << std::setw(6) << client.events.maps
+              << std::setw(6) << client.events.unmaps
+              << std::setw(6) << client.x_errors;
+    if (client.sync.counter == 0) {
+        std::cout << std::setw(8) << "-" << std::setw(8) << "-" << std::setw(6) << "-";
+    } else {
+        double average = client.sync.acks ? client.sync.total_latency_ms / client.sync.acks : 0;
+        std::cout << std::setw(8) << std::fixed << std::setprecision(1) << average
+                  << std::setw(8) << client.sync.max_latency_ms
+                  << std::setw(6) << client.sync.timeouts;
+    }
+    std::cout << "  " << client.wm_class << std::endl;
+}
+
+void print_resource_table() {
+    std::cout << std::setw(4) << "WS" << std::setw(12) << "WINDOW" << std::setw(8) << "PID"
+              << std::setw(8) << "CPU%" << std::setw(10) << "RSS(MiB)"
+              << std::setw(8) << "CONFIG" << std::setw(8) << "FOCUS" << std::setw(6) << "MAP"
+              << std::setw(6) << "UNMAP" << std::setw(6) << "XERR"
+              << std::setw(8) << "SYNCms" << std::setw(8) << "MAXms" << std::setw(6) << "LATE" << "  CLASS" << std::endl;
+    for (const auto& [id, workspace] : workspaces) {
+        for (xcb_window_t window : workspace.windows) {
+            print_client_row(id, window);
+        }
+    }
+    for (const Scratchpad& scratchpad : scratchpads) {
+        print_client_row(-1, scratchpad.window);
+    }
+    std::cout << "X errors: " << x_error_stats.total << " (" << x_error_stats.expected << " on destroyed windows)";
+    for (size_t opcode = 0; opcode < x_error_stats.by_opcode.size(); ++opcode) {
+        if (x_error_stats.by_opcode[opcode]) {
+            std::cout << " op" << opcode << "=" << x_error_stats.by_opcode[opcode];
+        }
+    }
+    std::cout << std::endl;
+}
+
+void handle_signal() {
+    signalfd_siginfo info;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) return;
+    if (info.ssi_signo == SIGUSR1) {
+        print_resource_table();
+    }
+}
+
+void hide_workspace_windows(xcb_connection_t* conn, int workspace_id) {
+    xcb_window_t fullscreen_window = workspaces[workspace_id].fullscreen_window;
+    for (xcb_window_t window : workspaces[workspace_id].windows) {
+        // Behind a fullscreen window everything else is already unmapped.
+        if (fullscreen_window == XCB_WINDOW_NONE || window == fullscreen_window) {
+            track_request(xcb_unmap_window(conn, window), window);
+            if (auto client = clients.find(window); client != clients.end()) {
+                client->second.expected_unmaps++;
+            }
+        }
+        set_client_hidden(conn, window, true);
+        auto client = clients.find(window);
+        if (client != clients.end()) {
+            freeze_client_process(client->second, workspace_id);
+        }
+    }
+    xcb_flush(conn);
+}
+
+void show_workspace_windows(xcb_connection_t* conn, int workspace_id) {
+    xcb_window_t fullscreen_window = workspaces[workspace_id].fullscreen_window;
+    for (xcb_window_t window : workspaces[workspace_id].windows) {
+        auto client = clients.find(window);
+        if (client != clients.end()) {
+            thaw_process(client->second.pid);
+        }
+        if (fullscreen_window != XCB_WINDOW_NONE && window != fullscreen_window) continue;
+        track_request(xcb_map_window(conn, window), window);
+        set_client_hidden(conn, window, false);
+    }
+    // Processes whose windows are gone would otherwise stay frozen forever.
+    if (std::erase_if(frozen_processes, [](const auto& entry) { return kill(entry.first, 0) != 0; }) > 0) {
+        frozen_processes_dirty = true;
+    }
+    xcb_flush(conn);
+}
+
+bool is_floating(xcb_window_t window) {
+    return std::find(floating_windows.begin(), floating_windows.end(), window) != floating_windows.end();
+}
+
+Scratchpad* find_scratchpad(xcb_window_t window) {
+    if (window == XCB_WINDOW_NONE) return nullptr;
+    for (Scratchpad& scratchpad : scratchpads) {
+        if (scratchpad.window == window) return &scratchpad;
+    }
+    return nullptr;
+}
+
+// The scratchpad whose command started the process that owns a new window.
+// A command that failed or never maps a window loses its claim after
+// SCRATCHPAD_CLAIM_TIMEOUT.
+Scratchpad* find_spawning_scratchpad(pid_t pid) {
+    auto now = std::chrono::steady_clock::now();
+    Scratchpad* found = nullptr;
+    for (Scratchpad& scratchpad : scratchpads) {
+        if (scratchpad.spawned_pid > 0 && now - scratchpad.spawned_at > SCRATCHPAD_CLAIM_TIMEOUT) {
+            std::cout << "Scratchpad " << scratchpad.name << " gave up waiting for its window" << std::endl;
+            scratchpad.spawned_pid = 0;
+        }
+        if (pid > 0 && scratchpad.window == XCB_WINDOW_NONE && scratchpad.spawned_pid == pid) {
+            found = &scratchpad;
+        }
+    }
+    return found;
+}
+
+// Returns the child's pid, or -1 if fork failed.
+pid_t spawn(const char* command) {
+    bool has_arguments = strchr(command, ' ') != nullptr;
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Signals swm reads through signalfd are blocked; don't pass that on.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigprocmask(SIG_SETMASK, &signals, nullptr);
+        setsid();
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+        if (has_arguments) {
+            execl("/bin/sh", "sh", "-c", command, NULL);
+        } else {
+            execlp(command, command, NULL);
+        }
+        _exit(127);
+    }
+    return pid;
+}
+
+// swm's own model of the stacking order of managed windows and docks, bottom
+// to top. stacking_raised is the order windows were last raised in; the wanted
+// order is that, sorted into layers. stacking_applied is what the server has,
+// so a restack only has to move the windows that are out of place.
+std::vector<xcb_window_t> stacking_raised;
+std::vector<xcb_window_t> stacking_applied;
+bool stacking_dirty = false;
+bool stacking_list_stale = false; // a window came or went; republish even without moves
+
+// A scratchpad is summoned over whatever is on screen, fullscreen windows
+// included. Docks stay above tiled windows but under anything raised by hand.
+int stacking_layer(xcb_window_t window) {
+    if (find_scratchpad(window)) return 4;
+    if (auto client = clients.find(window); client != clients.end() && client->second.fullscreen) return 3;
+    if (is_floating(window)) return 2;
+    if (docks.contains(window)) return 1;
+    return 0;
+}
+
+// New windows are created on top of their siblings, so that is where the
+// server has them too. Windows that existed before swm saw them (docks) are
+// left out of stacking_applied and placed explicitly on the next restack.
+void stacking_add(xcb_window_t window, bool on_top = true) {
+    stacking_raised.push_back(window);
+    if (on_top) stacking_applied.push_back(window);
+    stacking_dirty = true;
+    stacking_list_stale = true;
+}
+
+void stacking_remove(xcb_window_t window) {
+    std::erase(stacking_raised, window);
+    std::erase(stacking_applied, window);
+    stacking_dirty = true;
+    stacking_list_stale = true;
+}
+
+void stacking_raise(xcb_window_t window) {
+    auto it = std::find(stacking_raised.begin(), stacking_raised.end(), window);
+    if (it == stacking_raised.end()) return;
+    std::rotate(it, it + 1, stacking_raised.end());
+    stacking_dirty = true;
+}
+
+// Runs at the end of the event batch. Windows that form the longest run
+// already in the wanted relative order stay put; every other window is
+// placed directly above the one that should be below it.
+void apply_stacking(xcb_connection_t* conn, xcb_screen_t* screen) {
+    if (!stacking_dirty) return;
+    stacking_dirty = false;
+    std::vector<xcb_window_t> wanted = stacking_raised;
+    std::ranges::stable_sort(wanted, {}, stacking_layer);
+    if (wanted == stacking_applied && !stacking_list_stale) return;
+    stacking_list_stale = false;
+
+    std::unordered_map<xcb_window_t, int> applied_position;
+    for (size_t i = 0; i < stacking_applied.size(); ++i) {
+        applied_position[stacking_applied[i]] = i;
+    }
+    // Longest increasing subsequence of server positions, O(n log n).
+    std::vector<int> tails;       // index into wanted of the smallest tail per length
+    std::vector<int> previous(wanted.size(), -1);
+    for (size_t i = 0; i < wanted.size(); ++i) {
+        auto applied = applied_position.find(wanted[i]);
+        if (applied == applied_position.end()) continue; // position unknown, always placed
+        int position = applied->second;
+        auto it = std::ranges::lower_bound(tails, position, {}, [&](int index) { return applied_position[wanted[index]]; });
+        if (it != tails.begin()) previous[i] = *(it - 1);
+        if (it == tails.end()) tails.push_back(i);
+        else *it = i;
+    }
+    std::vector<bool> in_place(wanted.size(), false);
+    for (int i = tails.empty() ? -1 : tails.back(); i >= 0; i = previous[i]) {
+        in_place[i] = true;
+    }
+
+    int moved = 0;
+    for (size_t i = 0; i < wanted.size(); ++i) {
+        if (in_place[i]) continue;
+        if (i == 0) {
+            uint32_t values[] = { XCB_STACK_MODE_BELOW };
+            track_request(xcb_configure_window(conn, wanted[i], XCB_CONFIG_WINDOW_STACK_MODE, values), wanted[i]);
+        } else {
+            uint32_t values[] = { wanted[i - 1], XCB_STACK_MODE_ABOVE };
+            track_request(xcb_configure_window(conn, wanted[i], XCB_CONFIG_WINDOW_SIBLING | XCB_CONFIG_WINDOW_STACK_MODE, values), wanted[i]);
+        }
+        ++moved;
+    }
+    if (moved > 0) {
+        std::cout << "Restacked " << moved << " of " << wanted.size() << " windows" << std::endl;
+    }
+    stacking_applied = std::move(wanted);
+    std::vector<xcb_window_t> client_stacking;
+    std::ranges::copy_if(stacking_applied, std::back_inserter(client_stacking),
+                         [](xcb_window_t window) { return !docks.contains(window); });
+    xcb_change_property(
+        conn,
+        XCB_PROP_MODE_REPLACE,
+        screen->root,
+        ewmh._NET_CLIENT_LIST_STACKING,
+        XCB_ATOM_WINDOW,
+        32,
+        client_stacking.size(),
+        client_stacking.data()
+    );
+}
+
+uint32_t client_event_mask() {
+    uint32_t mask = XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_PROPERTY_CHANGE;
+    if (config && config->focus_follows_mouse) mask |= XCB_EVENT_MASK_ENTER_WINDOW;
+    return mask;
+}
+
+// Only unfocused clients carry a synchronous button grab, so the click that
+// focuses one reaches swm first and is then replayed. Clicks on the focused
+// client go straight to it and never wait for swm.
+void set_click_grab(xcb_connection_t* conn, xcb_window_t window, bool grabbed) {
+    auto client = clients.find(window);
+    if (client == clients.end() || client->second.click_grabbed == grabbed) return;
+    client->second.click_grabbed = grabbed;
+    if (grabbed) {
+        track_request(xcb_grab_button(conn, 0, window,
+            XCB_EVENT_MASK_BUTTON_PRESS,
+            XCB_GRAB_MODE_SYNC,
+            XCB_GRAB_MODE_ASYNC,
+            XCB_WINDOW_NONE,
+            XCB_CURSOR_NONE,
+            XCB_BUTTON_INDEX_1,
+            XCB_MOD_MASK_ANY), window);
+    } else {
+        track_request(xcb_ungrab_button(conn, XCB_BUTTON_INDEX_1, window, XCB_MOD_MASK_ANY), window);
+    }
+}
+
+// Records window_id as the focused window, whether swm or the client itself
+// moved the focus: border and click grab, the workspace's focused window and
+// MRU order, and _NET_ACTIVE_WINDOW.
+void mark_focused(xcb_connection_t* conn, xcb_window_t window_id) {
+    static xcb_window_t last_focused = XCB_WINDOW_NONE;
+    if (last_focused != XCB_WINDOW_NONE && last_focused != window_id) {
+        std::cout << "  Changing border of previous focused window " << last_focused << " to unfocused color." << std::endl;
+        track_request(xcb_change_window_attributes(conn, last_focused, XCB_CW_BORDER_PIXEL, &unfocused_border), last_focused);
+        set_click_grab(conn, last_focused, true);
+    }
+    if (window_id != XCB_WINDOW_NONE) {
+        track_request(xcb_change_window_attributes(conn, window_id, XCB_CW_BORDER_PIXEL, &focused_border), window_id);
+        set_click_grab(conn, window_id, false);
+        if (!find_scratchpad(window_id)) {
+            get_current_focused() = window_id;
+            if (!mru_cycle.active) mru_touch(window_id);
+        }
+    }
+    last_focused = window_id;
+    focused_client_window = window_id;
+    state_export_dirty = true;
+    xcb_change_property(
+        conn,
+        XCB_PROP_MODE_REPLACE,
+        screen->root,
+        ewmh._NET_ACTIVE_WINDOW,
+        XCB_ATOM_WINDOW,
+        32,
+        1,
+        &window_id);
+}
+
+void focus_client(xcb_connection_t* conn, xcb_window_t window_id) {
+    TraceSpan span("focus_client", window_id);
+    if (focused_client_window == window_id) return;
+
+    mark_focused(conn, window_id);
+    if (window_id != XCB_WINDOW_NONE) {
+        std::cout << "Focusing client " << window_id << std::endl;
+        track_request(xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, window_id, XCB_CURRENT_TIME), window_id);
+        stacking_raise(window_id);
+    }
+
+    xcb_flush(conn);
+}
+
+void kill_client(xcb_connection_t* conn, xcb_window_t window_id) {
+    if (window_id == XCB_WINDOW_NONE) {
+        std::cerr << "kill_client called with XCB_WINDOW_NONE. Aborting." << std::endl;
+        return;
+    }
+    std::cout << "Attempting to kill " << window_id << std::endl;
+    xcb_intern_atom_cookie_t wm_delete_window_cookie = xcb_intern_atom(conn, 0, strlen("WM_DELETE_WINDOW"), "WM_DELETE_WINDOW");
+    xcb_intern_atom_reply_t* wm_delete_window_reply = xcb_intern_atom_reply(conn, wm_delete_window_cookie, nullptr);
+    xcb_intern_atom_cookie_t wm_protocols_cookie = xcb_intern_atom(conn, 0, strlen("WM_PROTOCOLS"), "WM_PROTOCOLS");
+    xcb_intern_atom_reply_t* wm_protocols_reply = xcb_intern_atom_reply(conn, wm_protocols_cookie, nullptr);
+    if (wm_delete_window_reply && wm_protocols_reply) {
+        xcb_client_message_event_t event;
+        event.response_type = XCB_CLIENT_MESSAGE;
+        event.format = 32;
+        event.sequence = 0;
+        event.window = window_id;
+        event.type = wm_protocols_reply -> atom;
+        event.data.data32[0] = wm_delete_window_reply -> atom;
+        event.data.data32[1] = XCB_CURRENT_TIME;
+        track_request(xcb_send_event(conn, 0, window_id, XCB_EVENT_MASK_NO_EVENT, (const char*)&event), window_id);
+        xcb_flush(conn);
+    }
+    else {
+        std::cerr << "Could not send WM_DELETE_WINDOW, forcefully killing client." << std::endl;
+        xcb_kill_client(conn, window_id);
+        xcb_flush(conn);
+    }
+    free(wm_delete_window_reply);
+    free(wm_protocols_reply);
+}
+
+void grab_key_with_mods(xcb_connection_t* conn, xcb_window_t root, xcb_keycode_t keycode, uint16_t modifiers) {
+    uint16_t num_lock_mask = XCB_MOD_MASK_2;
+    uint16_t caps_lock_mask = XCB_MOD_MASK_LOCK;
+    xcb_grab_key(conn, 1, root, modifiers, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+    xcb_grab_key(conn, 1, root, modifiers | num_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+    xcb_grab_key(conn, 1, root, modifiers | caps_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+    xcb_grab_key(conn, 1, root, modifiers | num_lock_mask | caps_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+}
+
+void ungrab_key_with_mods(xcb_connection_t* conn, xcb_window_t root, xcb_keycode_t keycode, uint16_t modifiers) {
+    uint16_t num_lock_mask = XCB_MOD_MASK_2;
+    uint16_t caps_lock_mask = XCB_MOD_MASK_LOCK;
+    xcb_ungrab_key(conn, keycode, modifiers, root);
+    xcb_ungrab_key(conn, keycode, modifiers | caps_lock_mask, root);
+    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask, root);
+    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask | caps_lock_mask, root);
+    xcb_ungrab_key(conn, keycode, modifiers | num_lock_mask | caps_lock_mask, root);
+}
+
+uint32_t get_color_pixel(xcb_connection_t* conn, xcb_screen_t* screen, uint16_t red, uint16_t green, uint16_t blue) {
+    xcb_alloc_color_cookie_t color_cookie = xcb_alloc_color(conn, screen->default_colormap, red, green, blue);
+    xcb_alloc_color_reply_t* color_reply = xcb_alloc_color_reply(conn, color_cookie, NULL);
+    if (!color_reply) return screen->black_pixel;
+    uint32_t pixel = color_reply->pixel;
+    free(color_reply);
+    return pixel;
+}
+
+void apply_master_stack(xcb_connection_t* connection) {
+    TraceSpan span("apply_master_stack");
+    // The other windows are unmapped; they are laid out when fullscreen ends.
+    if (workspaces[current_workspace].fullscreen_window != XCB_WINDOW_NONE) return;
+    state_export_dirty = true;
+    auto& current_windows = get_current_windows();
+    std::vector<xcb_window_t> tilling_windows;
+    for (xcb_window_t window : current_windows) {
+        if (!is_floating(window)) {
+            tilling_windows.push_back(window);
+        }
+    }
+
+    if (!tilling_windows.empty()) {
+        if (tilling_windows.size() == 1) {
+            uint32_t fullscreen_geom[4] = {
+                (uint32_t)(work_area.x + gap_size), // x
+                (uint32_t)(work_area.y + gap_size), // y
+                (uint32_t)(work_area.width - 2 * gap_size),
+                (uint32_t)(work_area.height - 2 * gap_size)
+            };
+            configure_client(connection, tilling_windows[0], XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, fullscreen_geom);
+        } else {
+            xcb_window_t master = tilling_windows[0];
+            int usable_width = work_area.width - 2 * gap_size;
+            int usable_height = work_area.height - 2 * gap_size;
+            int master_width = (usable_width * master_ratio) - (gap_size / 2);
+            int stack_width = usable_width - master_width - gap_size;
+            int stack_count = tilling_windows.size() - 1;
+
+            uint32_t master_geom[4] = {
+                (uint32_t)(work_area.x + gap_size),
+                (uint32_t)(work_area.y + gap_size),
+                (uint32_t)master_width,
+                (uint32_t)usable_height
+            };
+            configure_client(connection, master,
+                XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+                master_geom);
+
+            for (size_t i = 1; i < tilling_windows.size(); ++i) {
+                int stack_height_per_window = (usable_height - (stack_count - 1) * gap_size) / stack_count;
+                int stack_y = work_area.y + gap_size + (i-1) * (stack_height_per_window + gap_size);
+                uint32_t stack_geom[4] = {
+                    (uint32_t)(work_area.x + gap_size + master_width + gap_size),
+                    (uint32_t)stack_y,
+                    (uint32_t)stack_width,
+                    (uint32_t)stack_height_per_window
+                };
+                configure_client(connection, tilling_windows[i],
+                    XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+                    stack_geom);
+
+            }
+        }
+    }
+    xcb_flush(connection);
+}
+
+void switch_workspace(xcb_connection_t* conn, xcb_screen_t* screen, int new_workspace) {
+    if (new_workspace == current_workspace || new_workspace < 0 || new_workspace >= WORKSPACE_LIMIT) {
         return;
     }
-    hide_workspace_windows(conn, current_workspace);
+    TraceSpan span("switch_workspace");
+    // Switch first so hiding already knows which processes stay visible.
+    int previous_workspace = current_workspace;
+    workspace_at(new_workspace);
     current_workspace = new_workspace;
+    state_export_dirty = true;
+    hide_workspace_windows(conn, previous_workspace);
+    release_workspace_if_empty(previous_workspace);
     show_workspace_windows(conn, current_workspace);
-    apply_master_stack(conn, screen);
+    apply_master_stack(conn);
     if (!get_current_windows().empty()) {
         if (get_current_focused() != XCB_WINDOW_NONE) {
             focus_client(conn, get_current_focused());
@@ -291,216 +1893,1414 @@ void switch_workspace(xcb_connection_t* conn, xcb_screen_t* screen, int new_work
             focus_client(conn, get_current_windows()[0]);
         }
     } else {
-        focused_client_window = XCB_WINDOW_NONE;
+        focused_client_window = XCB_WINDOW_NONE;
+    }
+    xcb_change_property(
+        conn,
+        XCB_PROP_MODE_REPLACE,
+        screen->root,
+        ewmh._NET_CURRENT_DESKTOP,
+        XCB_ATOM_CARDINAL,
+        32,
+        1,
+        &current_workspace
+    );
+    xcb_flush(conn);
+}
+
+void update_client_list(xcb_connection_t * conn, xcb_screen_t * screen);
+void set_fullscreen(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window, bool enable);
+
+void move_window_to_workspace(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window, int target_workspace) {
+    if (target_workspace < 0 || target_workspace >= WORKSPACE_LIMIT || target_workspace == current_workspace) {
+        return;
+    }
+    auto& current_windows = get_current_windows();
+    auto it = std::find(current_windows.begin(), current_windows.end(), window);
+    if (it != current_windows.end()) {
+        if (workspaces[current_workspace].fullscreen_window == window) {
+            set_fullscreen(conn, screen, window, false);
+            it = std::find(current_windows.begin(), current_windows.end(), window);
+        }
+        current_windows.erase(it);
+        workspace_at(target_workspace).windows.push_back(window);
+        mru_link(window, target_workspace, true);
+        workspaces[target_workspace].focused_window = window;
+        xcb_change_property(
+            conn,
+            XCB_PROP_MODE_REPLACE,
+            window,
+            ewmh._NET_WM_DESKTOP,
+            XCB_ATOM_CARDINAL,
+            32,
+            1,
+            &target_workspace
+        );
+        track_request(xcb_unmap_window(conn, window), window);
+        set_client_hidden(conn, window, true);
+        if (auto client = clients.find(window); client != clients.end()) {
+            client->second.expected_unmaps++;
+            freeze_client_process(client->second, target_workspace);
+        }
+
+        if (get_current_focused() == window) {
+            get_current_focused() = workspaces[current_workspace].mru_head;
+            if (get_current_focused() != XCB_WINDOW_NONE) {
+                focus_client(conn, get_current_focused());
+            } else {
+                focused_client_window = XCB_WINDOW_NONE;
+            }
+        }
+        update_client_list(conn, screen);
+        apply_master_stack(conn);
+        xcb_flush(conn);
+    }
+}
+
+void place_scratchpad(xcb_connection_t* conn, xcb_screen_t* screen, const Scratchpad& scratchpad) {
+    if (scratchpad.visible) {
+        uint32_t values[4] = {
+            (uint32_t)(screen->width_in_pixels / 6),
+            (uint32_t)(screen->height_in_pixels / 6),
+            (uint32_t)(screen->width_in_pixels * 2 / 3),
+            (uint32_t)(screen->height_in_pixels * 2 / 3)
+        };
+        configure_client(conn, scratchpad.window,
+            XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+            values);
+        stacking_raise(scratchpad.window);
+    } else {
+        // Parked just past the right edge of the root window, still mapped.
+        uint32_t values[1] = { screen->width_in_pixels };
+        configure_client(conn, scratchpad.window, XCB_CONFIG_WINDOW_X, values);
+    }
+}
+
+void toggle_scratchpad(xcb_connection_t* conn, xcb_screen_t* screen, Scratchpad& scratchpad) {
+    if (scratchpad.window == XCB_WINDOW_NONE) {
+        // Still waiting for the window of the last spawn; a second process
+        // would take the claim and leave the first window tiled.
+        if (scratchpad.spawned_pid > 0 &&
+            std::chrono::steady_clock::now() - scratchpad.spawned_at <= SCRATCHPAD_CLAIM_TIMEOUT) {
+            return;
+        }
+        if (scratchpad.command) {
+            std::cout << "Spawning scratchpad " << scratchpad.name << std::endl;
+            scratchpad.spawned_pid = spawn(scratchpad.command);
+            scratchpad.spawned_at = std::chrono::steady_clock::now();
+        }
+        return;
+    }
+    scratchpad.visible = !scratchpad.visible;
+    place_scratchpad(conn, screen, scratchpad);
+    if (scratchpad.visible) {
+        focus_client(conn, scratchpad.window);
+    } else if (focused_client_window == scratchpad.window) {
+        if (get_current_focused() != XCB_WINDOW_NONE) {
+            focus_client(conn, get_current_focused());
+        } else {
+            focus_client(conn, XCB_WINDOW_NONE);
+            xcb_set_input_focus(conn, XCB_INPUT_FOCUS_POINTER_ROOT, XCB_INPUT_FOCUS_POINTER_ROOT, XCB_CURRENT_TIME);
+        }
+    }
+    xcb_flush(conn);
+}
+
+void assign_scratchpad(xcb_connection_t* conn, xcb_screen_t* screen, Scratchpad& scratchpad, xcb_window_t window) {
+    if (window == XCB_WINDOW_NONE || find_scratchpad(window)) return;
+    auto& current_windows = get_current_windows();
+    auto it = std::find(current_windows.begin(), current_windows.end(), window);
+    if (it == current_windows.end()) return;
+    current_windows.erase(it);
+    mru_unlink(window);
+    auto float_it = std::find(floating_windows.begin(), floating_windows.end(), window);
+    if (float_it != floating_windows.end()) {
+        floating_windows.erase(float_it);
+    }
+
+    // A scratchpad holds a single window; the previous one goes back to tiling.
+    if (scratchpad.window != XCB_WINDOW_NONE) {
+        current_windows.push_back(scratchpad.window);
+        mru_link(scratchpad.window, current_workspace, false);
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, scratchpad.window, ewmh._NET_WM_DESKTOP,
+                            XCB_ATOM_CARDINAL, 32, 1, &current_workspace);
+    }
+    std::cout << "Window " << window << " is now scratchpad " << scratchpad.name << std::endl;
+    scratchpad.window = window;
+    scratchpad.visible = false;
+    uint32_t all_desktops = 0xFFFFFFFF;
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, window, ewmh._NET_WM_DESKTOP,
+                        XCB_ATOM_CARDINAL, 32, 1, &all_desktops);
+    place_scratchpad(conn, screen, scratchpad);
+    stacking_dirty = true;
+
+    if (get_current_focused() == window) {
+        get_current_focused() = workspaces[current_workspace].mru_head;
+    }
+    if (get_current_focused() != XCB_WINDOW_NONE) {
+        focus_client(conn, get_current_focused());
+    } else {
+        focus_client(conn, XCB_WINDOW_NONE);
+    }
+    update_client_list(conn, screen);
+    apply_master_stack(conn);
+}
+
+void toggle_floating(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window) {
+    if (window == XCB_WINDOW_NONE || workspaces[current_workspace].fullscreen_window == window) return;
+    auto it = std::find(floating_windows.begin(), floating_windows.end(), window);
+    if ( it != floating_windows.end() ) {
+        floating_windows.erase(it);
+        std::cout << "Window " << window << " is now tiled" << std::endl;
+    } else {
+        floating_windows.push_back(window);
+        std::cout << "Window " << window << " is now floating" << std::endl;
+        uint32_t floating_geom[4] = {
+            screen->width_in_pixels / 4,
+            screen->height_in_pixels / 4,
+            screen->width_in_pixels / 2,
+            screen->height_in_pixels / 2
+        };
+        configure_client(conn, window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, floating_geom);
+        stacking_raise(window);
+    }
+    stacking_dirty = true;
+    apply_master_stack(conn);
+    xcb_flush(conn);
+}
+
+void move_window_in_stack(xcb_connection_t* conn, bool move_up) {
+    auto& current_windows = get_current_windows();
+    xcb_window_t focused = get_current_focused();
+    if ( focused == XCB_WINDOW_NONE || current_windows.empty() ) return;
+    if (is_floating(focused)) return;
+    auto it = std::find(current_windows.begin(), current_windows.end(), focused);
+    if (it == current_windows.end()) return;
+    size_t current_pos = std::distance(current_windows.begin(), it);
+    size_t new_pos;
+    if (move_up) {
+        if (current_pos == 0) {
+            new_pos = current_windows.size() - 1;
+        } else {
+            new_pos = current_pos - 1;
+        }
+    } else {
+        new_pos = (current_pos + 1) % current_windows.size();
+    }
+    std::swap(current_windows[current_pos], current_windows[new_pos]);
+    apply_master_stack(conn);
+    focus_client(conn, focused);
+}
+
+void get_window_geometry(xcb_connection_t* conn, xcb_window_t window, int* x, int* y, int* width, int* height) {
+    xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, window);
+    xcb_get_geometry_reply_t* geom_reply = xcb_get_geometry_reply(conn, geom_cookie, nullptr);
+    if (geom_reply) {
+        *x = geom_reply->x;
+        *y = geom_reply->y;
+        *width = geom_reply->width;
+        *height = geom_reply->height;
+        free(geom_reply);
+    }
+}
+
+DragMode drag_mode_for(xcb_window_t window) {
+    auto client = clients.find(window);
+    if (client != clients.end()) {
+        for (const auto& [wm_class, mode] : config->drag_rules) {
+            if (client->second.wm_class == wm_class) return mode;
+        }
+    }
+    return default_drag_mode;
+}
+
+void draw_drag_outline(xcb_connection_t* conn) {
+    // XOR drawing: the same rectangle drawn twice restores the original pixels.
+    xcb_rectangle_t outline = {
+        (int16_t)drag_state.x,
+        (int16_t)drag_state.y,
+        (uint16_t)drag_state.width,
+        (uint16_t)drag_state.height
+    };
+    xcb_poly_rectangle(conn, screen->root, wireframe_gc, 1, &outline);
+    drag_state.outline_drawn = !drag_state.outline_drawn;
+}
+
+void arm_drag_timer(bool enable) {
+    itimerspec spec{};
+    if (enable) {
+        long period_ns = 1000000000L / std::max(drag_refresh_hz, 1);
+        spec.it_interval.tv_sec = period_ns / 1000000000L;
+        spec.it_interval.tv_nsec = period_ns % 1000000000L;
+        spec.it_value = spec.it_interval;
+    }
+    timerfd_settime(drag_timer_fd, 0, &spec, nullptr);
+}
+
+void apply_drag_geometry(xcb_connection_t* conn) {
+    if (drag_state.dragged_window == XCB_WINDOW_NONE) return;
+    uint32_t values[4] = {
+        (uint32_t)drag_state.x,
+        (uint32_t)drag_state.y,
+        (uint32_t)drag_state.width,
+        (uint32_t)drag_state.height
+    };
+    configure_client(conn, drag_state.dragged_window,
+                     XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+    drag_state.configure_pending = false;
+}
+
+void begin_drag_mode(xcb_connection_t* conn) {
+    drag_state.mode = drag_mode_for(drag_state.dragged_window);
+    drag_state.x = drag_state.start_win_x;
+    drag_state.y = drag_state.start_win_y;
+    drag_state.width = drag_state.start_width;
+    drag_state.height = drag_state.start_height;
+    drag_state.outline_drawn = false;
+    drag_state.configure_pending = false;
+
+    if (drag_state.mode == DragMode::Wireframe) {
+        // Keep other clients from painting over the outline while it is up.
+        xcb_grab_server(conn);
+        draw_drag_outline(conn);
+    } else if (drag_state.mode == DragMode::Paced) {
+        arm_drag_timer(true);
+    }
+}
+
+void handle_drag_timer(xcb_connection_t* conn) {
+    uint64_t expirations;
+    if (read(drag_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    if (drag_state.configure_pending) {
+        apply_drag_geometry(conn);
+        xcb_flush(conn);
+    }
+}
+
+int find_workspace_of(xcb_window_t window) {
+    auto client = clients.find(window);
+    return client == clients.end() ? -1 : client->second.workspace;
+}
+
+// A fullscreen window covers the whole screen without a border and bypasses
+// apply_master_stack(); the rest of its workspace is unmapped meanwhile so the
+// server only has to deal with one surface.
+void set_fullscreen(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window, bool enable) {
+    auto client_it = clients.find(window);
+    int workspace_id = find_workspace_of(window);
+    if (client_it == clients.end() || workspace_id < 0) return;
+    Client& client = client_it->second;
+    if (client.fullscreen == enable) return;
+    Workspaces& workspace = workspaces[workspace_id];
+    bool visible = workspace_id == current_workspace;
+
+    if (enable) {
+        if (workspace.fullscreen_window != XCB_WINDOW_NONE) {
+            set_fullscreen(conn, screen, workspace.fullscreen_window, false);
+        }
+        if (is_floating(window)) {
+            get_window_geometry(conn, window, &client.saved_x, &client.saved_y, &client.saved_width, &client.saved_height);
+        }
+        client.fullscreen = true;
+        workspace.fullscreen_window = window;
+        uint32_t values[5] = {
+            0, 0,
+            screen->width_in_pixels,
+            screen->height_in_pixels,
+            0
+        };
+        configure_client(conn, window,
+            XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT |
+            XCB_CONFIG_WINDOW_BORDER_WIDTH,
+            values);
+        if (visible) {
+            for (xcb_window_t other : workspace.windows) {
+                if (other == window) continue;
+                track_request(xcb_unmap_window(conn, other), other);
+                if (auto other_client = clients.find(other); other_client != clients.end()) {
+                    other_client->second.expected_unmaps++;
+                }
+            }
+        }
+        std::cout << "Window " << window << " is now fullscreen" << std::endl;
+    } else {
+        client.fullscreen = false;
+        workspace.fullscreen_window = XCB_WINDOW_NONE;
+        uint32_t border_width = 2;
+        configure_client(conn, window, XCB_CONFIG_WINDOW_BORDER_WIDTH, &border_width);
+        if (is_floating(window)) {
+            uint32_t values[4] = {
+                (uint32_t)client.saved_x,
+                (uint32_t)client.saved_y,
+                (uint32_t)client.saved_width,
+                (uint32_t)client.saved_height
+            };
+            configure_client(conn, window,
+                XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+                values);
+        }
+        if (visible) {
+            // They may have been marked hidden by a workspace switch while covered.
+            for (xcb_window_t other : workspace.windows) {
+                if (other == window) continue;
+                track_request(xcb_map_window(conn, other), other);
+                set_client_hidden(conn, other, false);
+            }
+        }
+        std::cout << "Window " << window << " left fullscreen" << std::endl;
+    }
+    publish_wm_state(conn, window, client);
+    stacking_dirty = true;
+    state_export_dirty = true;
+    if (visible) {
+        apply_master_stack(conn);
+        if (enable) focus_client(conn, window);
+    }
+    xcb_flush(conn);
+}
+
+void start_drag(xcb_connection_t* conn, xcb_window_t window, int pointer_x, int pointer_y) {
+    if (!is_floating(window) || workspaces[current_workspace].fullscreen_window == window) return;
+
+    drag_state.is_dragging = true;
+    drag_state.dragged_window = window;
+    drag_state.start_x = pointer_x;
+    drag_state.start_y = pointer_y;
+
+    get_window_geometry(conn, window, &drag_state.start_win_x, &drag_state.start_win_y,
+                       &drag_state.start_width, &drag_state.start_height);
+
+    xcb_grab_pointer(conn, 0, window,
+                    XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+                    XCB_WINDOW_NONE, XCB_CURSOR_NONE, XCB_CURRENT_TIME);
+    begin_drag_mode(conn);
+
+    std::cout << "Started dragging window " << window << std::endl;
+}
+
+void start_resize(xcb_connection_t* conn, xcb_window_t window, int pointer_x, int pointer_y) {
+    if (!is_floating(window) || workspaces[current_workspace].fullscreen_window == window) return;
+
+    drag_state.is_resizing = true;
+    drag_state.dragged_window = window;
+    drag_state.start_x = pointer_x;
+    drag_state.start_y = pointer_y;
+
+    get_window_geometry(conn, window, &drag_state.start_win_x, &drag_state.start_win_y,
+                       &drag_state.start_width, &drag_state.start_height);
+
+    xcb_grab_pointer(conn, 0, window,
+                    XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+                    XCB_WINDOW_NONE, XCB_CURSOR_NONE, XCB_CURRENT_TIME);
+    begin_drag_mode(conn);
+
+    std::cout << "Started resizing window " << window << std::endl;
+}
+
+void update_drag(xcb_connection_t* conn, int pointer_x, int pointer_y) {
+    if (!drag_state.is_dragging && !drag_state.is_resizing) return;
+
+    if (drag_state.mode == DragMode::Wireframe && drag_state.outline_drawn) {
+        draw_drag_outline(conn);
+    }
+    if (drag_state.is_dragging) {
+        drag_state.x = drag_state.start_win_x + (pointer_x - drag_state.start_x);
+        drag_state.y = drag_state.start_win_y + (pointer_y - drag_state.start_y);
+    } else if (drag_state.is_resizing) {
+        drag_state.width = std::max(100, drag_state.start_width + (pointer_x - drag_state.start_x));
+        drag_state.height = std::max(100, drag_state.start_height + (pointer_y - drag_state.start_y));
+    }
+
+    switch (drag_state.mode) {
+        case DragMode::Live:
+            apply_drag_geometry(conn);
+            break;
+        case DragMode::Wireframe:
+            draw_drag_outline(conn);
+            break;
+        case DragMode::Paced:
+            // Picked up by the next drag timer tick.
+            drag_state.configure_pending = true;
+            return;
+    }
+    xcb_flush(conn);
+}
+
+void end_drag(xcb_connection_t* conn) {
+    if (drag_state.is_dragging || drag_state.is_resizing) {
+        if (drag_state.mode == DragMode::Wireframe) {
+            if (drag_state.outline_drawn) {
+                draw_drag_outline(conn);
+            }
+            xcb_ungrab_server(conn);
+            apply_drag_geometry(conn);
+        } else if (drag_state.mode == DragMode::Paced) {
+            arm_drag_timer(false);
+            if (drag_state.configure_pending) {
+                apply_drag_geometry(conn);
+            }
+        }
+        xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+        std::cout << "Finished " << (drag_state.is_dragging ? "dragging" : "resizing")
+                  << " window " << drag_state.dragged_window << std::endl;
+    }
+
+    drag_state.is_dragging = false;
+    drag_state.is_resizing = false;
+    drag_state.dragged_window = XCB_WINDOW_NONE;
+    xcb_flush(conn);
+}
+
+void update_client_list(xcb_connection_t* conn, xcb_screen_t* screen) {
+    client_info_dirty = true;
+    state_export_dirty = true;
+    std::vector<xcb_window_t> all_windows;
+    for (const auto& [id, workspace] : workspaces) {
+        all_windows.insert(all_windows.end(), workspace.windows.begin(), workspace.windows.end());
+    }
+    // Same set as _NET_CLIENT_LIST_STACKING, which has the scratchpads too.
+    for (const Scratchpad& scratchpad : scratchpads) {
+        if (scratchpad.window != XCB_WINDOW_NONE) all_windows.push_back(scratchpad.window);
     }
     xcb_change_property(
         conn,
         XCB_PROP_MODE_REPLACE,
         screen->root,
-        ewmh._NET_CURRENT_DESKTOP,
-        XCB_ATOM_CARDINAL,
+        ewmh._NET_CLIENT_LIST,
+        XCB_ATOM_WINDOW,
         32,
-        1,
-        &current_workspace
+        all_windows.size(),
+        all_windows.data()
     );
-    xcb_flush(conn);
 }
 
-void update_client_list(xcb_connection_t * conn, xcb_screen_t * screen);
+Strut read_strut(xcb_connection_t* conn, xcb_get_property_cookie_t partial_cookie, xcb_get_property_cookie_t strut_cookie) {
+    Strut strut;
+    xcb_get_property_reply_t* partial_reply = xcb_get_property_reply(conn, partial_cookie, nullptr);
+    xcb_get_property_reply_t* strut_reply = xcb_get_property_reply(conn, strut_cookie, nullptr);
+    // _NET_WM_STRUT_PARTIAL takes precedence; its first four values match _NET_WM_STRUT.
+    xcb_get_property_reply_t* reply = nullptr;
+    if (partial_reply && xcb_get_property_value_length(partial_reply) >= 16) reply = partial_reply;
+    else if (strut_reply && xcb_get_property_value_length(strut_reply) >= 16) reply = strut_reply;
+    if (reply) {
+        auto* values = (uint32_t*)xcb_get_property_value(reply);
+        strut = { values[0], values[1], values[2], values[3] };
+    }
+    free(partial_reply);
+    free(strut_reply);
+    return strut;
+}
 
-void move_window_to_workspace(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window, int target_workspace) {
-    if (target_workspace < 0 || target_workspace >= MAX_WORKSPACES || target_workspace == current_workspace) {
-        return;
+void publish_work_area(xcb_connection_t* conn, xcb_screen_t* screen) {
+    std::vector<uint32_t> workareas;
+    for (uint32_t i = 0; i < desktop_count(); ++i) {
+        workareas.insert(workareas.end(), {
+            (uint32_t)work_area.x, (uint32_t)work_area.y, (uint32_t)work_area.width, (uint32_t)work_area.height
+        });
     }
-    auto& current_windows = get_current_windows();
-    auto it = std::find(current_windows.begin(), current_windows.end(), window);
-    if (it != current_windows.end()) {
-        current_windows.erase(it);
-        workspaces[target_workspace].windows.push_back(window);
-        xcb_change_property(
-            conn,
-            XCB_PROP_MODE_REPLACE,
-            window,
-            ewmh._NET_WM_DESKTOP,
-            XCB_ATOM_CARDINAL,
-            32,
-            1,
-            &target_workspace
-        );
-        xcb_unmap_window(conn, window);
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, ewmh._NET_WORKAREA, XCB_ATOM_CARDINAL, 32,
+                        workareas.size(), workareas.data());
+}
 
-        if (get_current_focused() == window) {
-            if (!current_windows.empty()) {
-                focus_client(conn, current_windows.back());
-            } else {
-                get_current_focused() = XCB_WINDOW_NONE;
+// Runs at the end of the event batch after workspaces were created or freed.
+void publish_desktops(xcb_connection_t* conn, xcb_screen_t* screen) {
+    static uint32_t published_count = 0;
+    if (!desktops_dirty) return;
+    desktops_dirty = false;
+    uint32_t count = desktop_count();
+    if (count == published_count) return;
+    published_count = count;
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, ewmh._NET_NUMBER_OF_DESKTOPS,
+                        XCB_ATOM_CARDINAL, 32, 1, &count);
+    publish_work_area(conn, screen);
+}
+
+// Called whenever a strut appears, changes or goes away. Relayouts only if the
+// resulting work area actually moved.
+void update_work_area(xcb_connection_t* conn, xcb_screen_t* screen) {
+    Strut reserved;
+    for (const auto& [dock, strut] : docks) {
+        reserved.left = std::max(reserved.left, strut.left);
+        reserved.right = std::max(reserved.right, strut.right);
+        reserved.top = std::max(reserved.top, strut.top);
+        reserved.bottom = std::max(reserved.bottom, strut.bottom);
+    }
+    WorkArea next;
+    next.x = reserved.left;
+    next.y = reserved.top;
+    next.width = std::max(1, (int)screen->width_in_pixels - (int)(reserved.left + reserved.right));
+    next.height = std::max(1, (int)screen->height_in_pixels - (int)(reserved.top + reserved.bottom));
+    if (next == work_area) return;
+    work_area = next;
+    std::cout << "Work area is now " << work_area.width << "x" << work_area.height
+              << "+" << work_area.x << "+" << work_area.y << std::endl;
+    publish_work_area(conn, screen);
+    apply_master_stack(conn);
+}
+
+void refresh_dock_strut(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t dock) {
+    xcb_get_property_cookie_t partial_cookie = xcb_get_property(conn, 0, dock, ewmh._NET_WM_STRUT_PARTIAL, XCB_ATOM_CARDINAL, 0, 12);
+    xcb_get_property_cookie_t strut_cookie = xcb_get_property(conn, 0, dock, ewmh._NET_WM_STRUT, XCB_ATOM_CARDINAL, 0, 4);
+    Strut strut = read_strut(conn, partial_cookie, strut_cookie);
+    auto it = docks.find(dock);
+    if (it == docks.end() || it->second == strut) return;
+    it->second = strut;
+    update_work_area(conn, screen);
+}
+
+void queue_metadata_refresh(xcb_window_t window);
+
+// The requests swm needs answered before it can manage a window. Sending them
+// all before reading any reply keeps it to one round trip, also for many windows.
+struct WindowQuery {
+    xcb_window_t window;
+    xcb_get_window_attributes_cookie_t attributes;
+    xcb_get_property_cookie_t wm_class, pid, machine, state, type, strut_partial, strut, desktop, protocols, sync_counter;
+};
+
+struct WindowInfo {
+    bool override_redirect = false;
+    bool viewable = false;
+    bool is_dock = false;
+    bool wants_fullscreen = false;
+    bool has_desktop = false;
+    uint32_t desktop = 0;
+    Strut strut;
+    Client client; // class and pid, moved into clients once the window is managed
+};
+
+WindowQuery query_window(xcb_connection_t* conn, xcb_window_t window) {
+    return {
+        window,
+        xcb_get_window_attributes(conn, window),
+        xcb_get_property(conn, 0, window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 256),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_PID, XCB_ATOM_CARDINAL, 0, 1),
+        xcb_get_property(conn, 0, window, XCB_ATOM_WM_CLIENT_MACHINE, XCB_ATOM_STRING, 0, 64),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_STATE, XCB_ATOM_ATOM, 0, 32),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_WINDOW_TYPE, XCB_ATOM_ATOM, 0, 32),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_STRUT_PARTIAL, XCB_ATOM_CARDINAL, 0, 12),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_STRUT, XCB_ATOM_CARDINAL, 0, 4),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_DESKTOP, XCB_ATOM_CARDINAL, 0, 1),
+        xcb_get_property(conn, 0, window, swm_atoms.WM_PROTOCOLS, XCB_ATOM_ATOM, 0, 16),
+        xcb_get_property(conn, 0, window, ewmh._NET_WM_SYNC_REQUEST_COUNTER, XCB_ATOM_CARDINAL, 0, 1),
+    };
+}
+
+bool property_has_atom(xcb_connection_t* conn, xcb_get_property_cookie_t cookie, xcb_atom_t atom) {
+    xcb_get_property_reply_t* reply = xcb_get_property_reply(conn, cookie, nullptr);
+    if (!reply) return false;
+    auto* atoms = (xcb_atom_t*)xcb_get_property_value(reply);
+    int count = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+    bool found = std::find(atoms, atoms + count, atom) != atoms + count;
+    free(reply);
+    return found;
+}
+
+WindowInfo collect_window(xcb_connection_t* conn, const WindowQuery& query) {
+    WindowInfo info;
+    if (xcb_get_window_attributes_reply_t* attributes = xcb_get_window_attributes_reply(conn, query.attributes, nullptr)) {
+        info.override_redirect = attributes->override_redirect;
+        info.viewable = attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+        free(attributes);
+    }
+    read_wm_class(conn, query.wm_class, info.client);
+    read_client_pid(conn, query.pid, query.machine, info.client);
+    info.wants_fullscreen = property_has_atom(conn, query.state, ewmh._NET_WM_STATE_FULLSCREEN);
+    info.is_dock = property_has_atom(conn, query.type, ewmh._NET_WM_WINDOW_TYPE_DOCK);
+    info.strut = read_strut(conn, query.strut_partial, query.strut);
+    if (xcb_get_property_reply_t* desktop = xcb_get_property_reply(conn, query.desktop, nullptr)) {
+        if (xcb_get_property_value_length(desktop) >= 4) {
+            info.has_desktop = true;
+            info.desktop = *(uint32_t*)xcb_get_property_value(desktop);
+        }
+        free(desktop);
+    }
+    bool supports_sync = property_has_atom(conn, query.protocols, ewmh._NET_WM_SYNC_REQUEST);
+    if (xcb_get_property_reply_t* counter = xcb_get_property_reply(conn, query.sync_counter, nullptr)) {
+        if (supports_sync && xcb_get_property_value_length(counter) >= 4) {
+            info.client.sync.counter = *(uint32_t*)xcb_get_property_value(counter);
+        }
+        free(counter);
+    }
+    return info;
+}
+
+// Tracks the strut of a dock; the caller updates the work area.
+void register_dock(xcb_connection_t* conn, xcb_window_t window, const Strut& strut) {
+    uint32_t dock_mask = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    track_request(xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, &dock_mask), window);
+    if (!docks.contains(window)) stacking_add(window, false);
+    docks[window] = strut;
+}
+
+// Everything a managed window gets regardless of where it ends up. Mapping,
+// placing it on a workspace and focusing it are up to the caller.
+void setup_client_window(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window, Client&& client) {
+    clients[window] = std::move(client);
+    queue_metadata_refresh(window);
+    stacking_add(window);
+    setup_client_sync(conn, window, clients[window].sync);
+
+    uint32_t values[4];
+    uint16_t mask_config = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+    values[0] = 0;
+    values[1] = 0;
+    values[2] = screen->width_in_pixels;
+    values[3] = screen->height_in_pixels;
+    track_request(xcb_configure_window(conn, window, mask_config, values), window);
+    // Nothing is drawn yet, so there is no frame to wait for; configure_client()
+    // only needs to know the size for the next resize.
+    clients[window].sync.width = values[2];
+    clients[window].sync.height = values[3];
+    clients[window].width = values[2];
+    clients[window].height = values[3];
+
+    uint32_t border_width = 2;
+    track_request(xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_BORDER_WIDTH, &border_width), window);
+
+    uint32_t client_mask = client_event_mask();
+    track_request(xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, &client_mask), window);
+
+    set_click_grab(conn, window, true);
+
+    track_request(xcb_change_window_attributes(conn, window, XCB_CW_BORDER_PIXEL, &unfocused_border), window);
+
+    xcb_configure_notify_event_t configure_notify_event;
+    configure_notify_event.response_type = XCB_CONFIGURE_NOTIFY;
+    configure_notify_event.event = window;
+    configure_notify_event.window = window;
+    configure_notify_event.x = values[0];
+    configure_notify_event.y = values[1];
+    configure_notify_event.width = values[2];
+    configure_notify_event.height = values[3];
+    configure_notify_event.border_width = 0;
+    configure_notify_event.above_sibling = XCB_WINDOW_NONE;
+    configure_notify_event.override_redirect = false;
+    track_request(xcb_send_event(conn, 0, window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&configure_notify_event), window);
+}
+
+// Manages the windows that already exist when swm starts, e.g. after a crash
+// or when swm is started after the session. All per-window requests go out in
+// one batch and every window goes back to the desktop in its _NET_WM_DESKTOP.
+void adopt_existing_windows(xcb_connection_t* conn, xcb_screen_t* screen) {
+    resume_orphaned_processes(conn, screen);
+    xcb_query_tree_reply_t* tree = xcb_query_tree_reply(conn, xcb_query_tree(conn, screen->root), nullptr);
+    if (!tree) return;
+    xcb_window_t* children = xcb_query_tree_children(tree);
+    int child_count = xcb_query_tree_children_length(tree);
+
+    std::vector<WindowQuery> queries;
+    queries.reserve(child_count);
+    for (int i = 0; i < child_count; ++i) {
+        queries.push_back(query_window(conn, children[i]));
+    }
+    free(tree);
+
+    std::vector<xcb_window_t> fullscreen_windows;
+    int adopted = 0;
+    for (const WindowQuery& query : queries) {
+        WindowInfo info = collect_window(conn, query);
+        // Unmapped windows without a desktop were never managed by a window manager.
+        if (info.override_redirect || (!info.viewable && !info.has_desktop)) continue;
+        if (info.is_dock) {
+            register_dock(conn, query.window, info.strut);
+            continue;
+        }
+        int workspace_id = info.has_desktop && info.desktop < WORKSPACE_LIMIT ? (int)info.desktop : current_workspace;
+        // Stopped by an instance that left no record; continuing a running process is harmless.
+        if (freeze_policy_for(info.client) == FreezePolicy::Stop) {
+            kill(info.client.pid, SIGCONT);
+        }
+        setup_client_window(conn, screen, query.window, std::move(info.client));
+        workspace_at(workspace_id).windows.push_back(query.window);
+        mru_link(query.window, workspace_id, false);
+        xcb_change_property(conn, XCB_PROP_MODE_REPLACE, query.window, ewmh._NET_WM_DESKTOP,
+                            XCB_ATOM_CARDINAL, 32, 1, &workspace_id);
+        if (workspace_id == current_workspace) {
+            track_request(xcb_map_window(conn, query.window), query.window);
+        } else {
+            if (info.viewable) {
+                track_request(xcb_unmap_window(conn, query.window), query.window);
+                clients[query.window].expected_unmaps++;
+            }
+            set_client_hidden(conn, query.window, true);
+        }
+        if (info.wants_fullscreen) {
+            fullscreen_windows.push_back(query.window);
+        }
+        ++adopted;
+    }
+    std::cout << "Adopted " << adopted << " of " << queries.size() << " existing windows" << std::endl;
+
+    for (const auto& [id, workspace] : workspaces) {
+        if (id == current_workspace) continue;
+        for (xcb_window_t window : workspace.windows) {
+            freeze_client_process(clients[window], id);
+        }
+    }
+    // A single relayout for the visible workspace; the others are laid out when shown.
+    update_work_area(conn, screen);
+    apply_master_stack(conn);
+    for (xcb_window_t window : fullscreen_windows) {
+        set_fullscreen(conn, screen, window, true);
+    }
+    update_client_list(conn, screen);
+    if (!get_current_windows().empty()) {
+        focus_client(conn, get_current_windows().back());
+    }
+    xcb_flush(conn);
+}
+
+// Drops a dock that was destroyed or unmapped, together with its strut.
+bool forget_dock(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window) {
+    if (!docks.erase(window)) return false;
+    stacking_remove(window);
+    update_work_area(conn, screen);
+    return true;
+}
+
+// Forgets a window that no longer exists. Safe to call for windows swm never managed.
+void unmanage_client(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window) {
+    if (forget_dock(conn, screen, window)) return;
+    int workspace_id = find_workspace_of(window);
+    if (auto client = clients.find(window); client != clients.end()) {
+        release_client_sync(conn, client->second.sync);
+        if (client->second.sync.waiting) {
+            std::erase(sync_waiting, window);
+            arm_sync_timer();
+        }
+    }
+    mru_unlink(window);
+    stacking_remove(window);
+    clients.erase(window);
+    if (drag_state.dragged_window == window) {
+        drag_state.dragged_window = XCB_WINDOW_NONE;
+        end_drag(conn);
+    }
+    bool found = false;
+    if (auto it = workspaces.find(workspace_id); it != workspaces.end()) {
+        Workspaces& workspace = it->second;
+        found = std::erase(workspace.windows, window) > 0;
+        if (workspace.fullscreen_window == window) {
+            workspace.fullscreen_window = XCB_WINDOW_NONE;
+            if (workspace_id == current_workspace) {
+                for (xcb_window_t other : workspace.windows) {
+                    track_request(xcb_map_window(conn, other), other);
+                    set_client_hidden(conn, other, false);
+                }
+            }
+        }
+        if (workspace.focused_window == window) {
+            workspace.focused_window = workspace.mru_head;
+            if (workspace_id == current_workspace && focused_client_window == window) {
                 focused_client_window = XCB_WINDOW_NONE;
+                focus_fallback_pending = true;
             }
         }
+        release_workspace_if_empty(workspace_id);
+    }
+    if (Scratchpad* scratchpad = find_scratchpad(window)) {
+        scratchpad->window = XCB_WINDOW_NONE;
+        scratchpad->visible = false;
+        if (focused_client_window == window) {
+            focused_client_window = XCB_WINDOW_NONE;
+            focus_fallback_pending = true;
+        }
+        found = true;
+    }
+    auto float_it = std::find(floating_windows.begin(), floating_windows.end(), window);
+    if (float_it != floating_windows.end()) {
+        floating_windows.erase(float_it);
+    }
+    if (found) {
         update_client_list(conn, screen);
-        apply_master_stack(conn, screen);
-        xcb_flush(conn);
+        apply_master_stack(conn);
     }
 }
 
-void toggle_floating(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window) {
-    if (window == XCB_WINDOW_NONE) return;
-    auto it = std::find(floating_windows.begin(), floating_windows.end(), window);
-    if ( it != floating_windows.end() ) {
-        floating_windows.erase(it);
-        std::cout << "Window " << window << " is now tiled" << std::endl;
-    } else {
-        floating_windows.push_back(window);
-        std::cout << "Window " << window << " is now floating" << std::endl;
-        uint32_t floating_geom[4] = {
-            screen->width_in_pixels / 4,
-            screen->height_in_pixels / 4,
-            screen->width_in_pixels / 2,
-            screen->height_in_pixels / 2
-        };
-        xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, floating_geom);
-        uint32_t values[] = { XCB_STACK_MODE_ABOVE };
-        xcb_configure_window(conn, window, XCB_CONFIG_WINDOW_STACK_MODE, values);
+const char* x_error_name(uint8_t error_code) {
+    static const char* names[] = {
+        "Success", "BadRequest", "BadValue", "BadWindow", "BadPixmap", "BadAtom", "BadCursor", "BadFont",
+        "BadMatch", "BadDrawable", "BadAccess", "BadAlloc", "BadColormap", "BadGContext", "BadIDChoice",
+        "BadName", "BadLength", "BadImplementation"
+    };
+    return error_code < std::size(names) ? names[error_code] : "extension error";
+}
+
+const char* x_request_name(uint8_t opcode) {
+    switch (opcode) {
+        case XCB_CHANGE_WINDOW_ATTRIBUTES: return "ChangeWindowAttributes";
+        case XCB_GET_WINDOW_ATTRIBUTES: return "GetWindowAttributes";
+        case XCB_MAP_WINDOW: return "MapWindow";
+        case XCB_UNMAP_WINDOW: return "UnmapWindow";
+        case XCB_CONFIGURE_WINDOW: return "ConfigureWindow";
+        case XCB_CIRCULATE_WINDOW: return "CirculateWindow";
+        case XCB_GET_GEOMETRY: return "GetGeometry";
+        case XCB_CHANGE_PROPERTY: return "ChangeProperty";
+        case XCB_GET_PROPERTY: return "GetProperty";
+        case XCB_SEND_EVENT: return "SendEvent";
+        case XCB_GRAB_BUTTON: return "GrabButton";
+        case XCB_UNGRAB_BUTTON: return "UngrabButton";
+        case XCB_SET_INPUT_FOCUS: return "SetInputFocus";
+        case XCB_POLY_RECTANGLE: return "PolyRectangle";
+        case XCB_KILL_CLIENT: return "KillClient";
+        default: return "request";
     }
-    apply_master_stack(conn, screen);
-    xcb_flush(conn);
 }
 
-void move_window_in_stack(xcb_connection_t* conn, xcb_screen_t* screen, bool move_up) {
-    auto& current_windows = get_current_windows();
-    xcb_window_t focused = get_current_focused();
-    if ( focused == XCB_WINDOW_NONE || current_windows.empty() ) return;
-    if (is_floating(focused)) return;
-    auto it = std::find(current_windows.begin(), current_windows.end(), focused);
-    if (it == current_windows.end()) return;
-    size_t current_pos = std::distance(current_windows.begin(), it);
-    size_t new_pos;
-    if (move_up) {
-        if (current_pos == 0) {
-            new_pos = current_windows.size() - 1;
+void handle_x_error(xcb_connection_t* conn, xcb_screen_t* screen, const xcb_generic_error_t* error) {
+    x_error_stats.total++;
+    x_error_stats.by_opcode[error->major_code]++;
+
+    xcb_window_t window = XCB_WINDOW_NONE;
+    const TrackedRequest& tracked = tracked_requests[error->full_sequence % TRACKED_REQUESTS];
+    if (tracked.sequence == error->full_sequence) {
+        window = tracked.window;
+    }
+    // The tracked window is who the request was for, not necessarily what is
+    // gone: a restack relative to a destroyed sibling names the sibling.
+    bool window_gone = error->error_code == XCB_WINDOW || error->error_code == XCB_DRAWABLE;
+    xcb_window_t gone_window = window_gone ? error->resource_id : (xcb_window_t)XCB_WINDOW_NONE;
+    if (window == XCB_WINDOW_NONE) {
+        window = gone_window;
+    }
+
+    if (window != XCB_WINDOW_NONE && clients.contains(window)) {
+        clients[window].x_errors++;
+    }
+    if (window_gone && !clients.contains(gone_window) && !docks.contains(gone_window)) {
+        // The usual race: a request for a window whose DestroyNotify was already handled.
+        x_error_stats.expected++;
+        return;
+    }
+
+    std::cerr << "X error " << x_error_name(error->error_code) << " from " << x_request_name(error->major_code)
+              << " (opcode " << (int)error->major_code << "." << (int)error->minor_code
+              << ", sequence " << error->full_sequence << ") on window " << window << std::endl;
+    if (window_gone) {
+        std::cerr << "  Dropping stale window " << gone_window << std::endl;
+        unmanage_client(conn, screen, gone_window);
+    }
+}
+
+void activate_window(xcb_connection_t* conn, xcb_screen_t* screen, xcb_window_t window) {
+    if (Scratchpad* scratchpad = find_scratchpad(window)) {
+        if (!scratchpad->visible) {
+            toggle_scratchpad(conn, screen, *scratchpad);
         } else {
-            new_pos = current_pos - 1;
+            focus_client(conn, window);
+        }
+        return;
+    }
+    int workspace_id = find_workspace_of(window);
+    if (workspace_id < 0) return;
+    if (workspace_id != current_workspace) {
+        switch_workspace(conn, screen, workspace_id);
+    }
+    focus_client(conn, window);
+}
+
+void queue_metadata_refresh(xcb_window_t window) {
+    auto client = clients.find(window);
+    if (client == clients.end() || client->second.metadata_stale) return;
+    client->second.metadata_stale = true;
+    metadata_pending.push_back(window);
+}
+
+std::string_view property_text(xcb_get_property_reply_t* reply) {
+    if (!reply) return {};
+    return std::string_view((const char*)xcb_get_property_value(reply), xcb_get_property_value_length(reply));
+}
+
+// Runs once per event batch: every window whose title or class changed since
+// the last batch is refetched with one pipelined round of GetProperty.
+void refresh_client_metadata(xcb_connection_t* conn) {
+    struct Fetch {
+        xcb_window_t window;
+        xcb_get_property_cookie_t net_name, name, wm_class;
+    };
+    std::vector<Fetch> fetches;
+    for (xcb_window_t window : metadata_pending) {
+        if (!clients.contains(window)) continue;
+        fetches.push_back({
+            window,
+            xcb_get_property(conn, 0, window, ewmh._NET_WM_NAME, swm_atoms.UTF8_STRING, 0, 256),
+            xcb_get_property(conn, 0, window, XCB_ATOM_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, 0, 256),
+            xcb_get_property(conn, 0, window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 256),
+        });
+    }
+    metadata_pending.clear();
+    for (const Fetch& fetch : fetches) {
+        xcb_get_property_reply_t* net_name = xcb_get_property_reply(conn, fetch.net_name, nullptr);
+        xcb_get_property_reply_t* name = xcb_get_property_reply(conn, fetch.name, nullptr);
+        auto client = clients.find(fetch.window);
+        if (client != clients.end()) {
+            std::string_view title = property_text(net_name);
+            if (title.empty()) title = property_text(name);
+            client->second.title = InternedString(title);
+            read_wm_class(conn, fetch.wm_class, client->second);
+            client->second.metadata_stale = false;
+            client_info_dirty = true;
+            state_export_dirty = true;
+        } else {
+            xcb_discard_reply(conn, fetch.wm_class.sequence);
+        }
+        free(net_name);
+        free(name);
+    }
+}
+
+void append_client_info(std::string& info, xcb_window_t window, int workspace_id) {
+    auto client = clients.find(window);
+    if (client == clients.end()) return;
+    auto append_field = [&](std::string_view text) {
+        info += '\t';
+        for (char c : text) info += (c == '\t' || c == '\n') ? ' ' : c;
+    };
+    info += std::to_string(window);
+    info += '\t';
+    info += std::to_string(workspace_id);
+    append_field(client->second.wm_instance.view());
+    append_field(client->second.wm_class.view());
+    append_field(client->second.title.view());
+    info += '\n';
+}
+
+// _SWM_CLIENT_INFO on the root window holds one line per client:
+// window, desktop (-1 for scratchpads), instance, class and title, separated
+// by tabs. A switcher gets everything with a single GetProperty.
+void publish_client_info(xcb_connection_t* conn, xcb_screen_t* screen) {
+    if (!client_info_dirty) return;
+    client_info_dirty = false;
+    std::string info;
+    for (const auto& [id, workspace] : workspaces) {
+        for (xcb_window_t window : workspace.windows) {
+            append_client_info(info, window, id);
+        }
+    }
+    for (const Scratchpad& scratchpad : scratchpads) {
+        append_client_info(info, scratchpad.window, -1);
+    }
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, screen->root, swm_atoms._SWM_CLIENT_INFO,
+                        swm_atoms.UTF8_STRING, 8, info.size(), info.data());
+}
+
+// Subsequence match of an already lowercased query. Consecutive characters
+// and matches at word starts score higher; -1 means no match.
+int fuzzy_score(std::string_view query, std::string_view folded) {
+    int score = 0;
+    int streak = 0;
+    size_t position = 0;
+    for (char c : query) {
+        size_t found = folded.find(c, position);
+        if (found == std::string_view::npos) return -1;
+        streak = (found == position && position > 0) ? streak + 1 : 0;
+        bool word_start = found == 0 || !isalnum((unsigned char)folded[found - 1]);
+        score += 1 + 2 * streak + (word_start ? 3 : 0) - (int)std::min<size_t>(found - position, 3);
+        position = found + 1;
+    }
+    return score;
+}
+
+xcb_window_t fuzzy_find_client(std::string_view query) {
+    std::string folded_query(query.size(), '\0');
+    std::transform(query.begin(), query.end(), folded_query.begin(), [](unsigned char c) { return tolower(c); });
+    xcb_window_t best = XCB_WINDOW_NONE;
+    int best_score = -1;
+    for (const auto& [window, client] : clients) {
+        int score = std::max(fuzzy_score(folded_query, client.title.folded()),
+                             fuzzy_score(folded_query, client.wm_class.folded()));
+        if (score > best_score) {
+            best_score = score;
+            best = window;
+        }
+    }
+    return best;
+}
+
+void handle_switch_query(xcb_connection_t* conn, xcb_screen_t* screen) {
+    xcb_get_property_cookie_t cookie = xcb_get_property(conn, 0, screen->root, swm_atoms._SWM_SWITCH_QUERY,
+                                                        XCB_GET_PROPERTY_TYPE_ANY, 0, 64);
+    xcb_get_property_reply_t* reply = xcb_get_property_reply(conn, cookie, nullptr);
+    std::string_view query = property_text(reply);
+    if (!query.empty()) {
+        auto start = std::chrono::steady_clock::now();
+        xcb_window_t match = fuzzy_find_client(query);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "Switch query '" << query << "' matched " << match << " among " << clients.size()
+                  << " clients in " << elapsed.count() << "us" << std::endl;
+        if (match != XCB_WINDOW_NONE) {
+            activate_window(conn, screen, match);
         }
-    } else {
-        new_pos = (current_pos + 1) % current_windows.size();
     }
-    std::swap(current_windows[current_pos], current_windows[new_pos]);
-    apply_master_stack(conn, screen);
-    focus_client(conn, focused);
+    free(reply);
 }
 
-void get_window_geometry(xcb_connection_t* conn, xcb_window_t window, int* x, int* y, int* width, int* height) {
-    xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, window);
-    xcb_get_geometry_reply_t* geom_reply = xcb_get_geometry_reply(conn, geom_cookie, nullptr);
-    if (geom_reply) {
-        *x = geom_reply->x;
-        *y = geom_reply->y;
-        *width = geom_reply->width;
-        *height = geom_reply->height;
-        free(geom_reply);
+void focus_next_in_stack(xcb_connection_t* conn, bool forward) {
+    auto& current_windows = get_current_windows();
+    if (current_windows.empty()) return;
+    auto it = std::find(current_windows.begin(), current_windows.end(), get_current_focused());
+    if (it == current_windows.end()) {
+        focus_client(conn, forward ? current_windows[0] : current_windows.back());
+    } else if (forward) {
+        ++it;
+        focus_client(conn, it == current_windows.end() ? current_windows[0] : *it);
+    } else {
+        focus_client(conn, it == current_windows.begin() ? current_windows.back() : *(it - 1));
     }
 }
 
-void start_drag(xcb_connection_t* conn, xcb_window_t window, int pointer_x, int pointer_y) {
-    if (!is_floating(window)) return;
+// Steps through the workspaces in use in id order, wrapping around.
+int adjacent_workspace(bool forward) {
+    auto current = workspaces.find(current_workspace);
+    if (forward) {
+        auto next = std::next(current);
+        return next == workspaces.end() ? workspaces.begin()->first : next->first;
+    }
+    return current == workspaces.begin() ? workspaces.rbegin()->first : std::prev(current)->first;
+}
 
-    drag_state.is_dragging = true;
-    drag_state.dragged_window = window;
-    drag_state.start_x = pointer_x;
-    drag_state.start_y = pointer_y;
+int first_free_workspace() {
+    int id = 0;
+    for (const auto& [used, workspace] : workspaces) {
+        if (used != id) break;
+        ++id;
+    }
+    return id;
+}
 
-    get_window_geometry(conn, window, &drag_state.start_win_x, &drag_state.start_win_y,
-                       &drag_state.start_width, &drag_state.start_height);
+// Focuses the window used before the current one.
+void focus_last(xcb_connection_t* conn) {
+    xcb_window_t target = workspaces[current_workspace].mru_head;
+    if (target == focused_client_window && target != XCB_WINDOW_NONE) {
+        target = clients[target].mru_next;
+    }
+    if (target != XCB_WINDOW_NONE) {
+        focus_client(conn, target);
+    }
+}
 
-    xcb_grab_pointer(conn, 0, window,
-                    XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
-                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
-                    XCB_WINDOW_NONE, XCB_CURSOR_NONE, XCB_CURRENT_TIME);
+// Keycodes that produce any of the modifiers in mask under the current keymap.
+std::vector<xcb_keycode_t> modifier_keycodes(xcb_connection_t* conn, uint16_t mask) {
+    std::vector<xcb_keycode_t> keycodes;
+    xcb_get_modifier_mapping_reply_t* mapping = xcb_get_modifier_mapping_reply(conn, xcb_get_modifier_mapping(conn), nullptr);
+    if (!mapping) return keycodes;
+    const xcb_keycode_t* codes = xcb_get_modifier_mapping_keycodes(mapping);
+    int per_modifier = mapping->keycodes_per_modifier;
+    // Eight rows of per_modifier keycodes: Shift, Lock, Control, Mod1 .. Mod5.
+    for (int i = 0; i < 8 * per_modifier; ++i) {
+        if (codes[i] != 0 && (mask & (1 << (i / per_modifier)))) {
+            keycodes.push_back(codes[i]);
+        }
+    }
+    free(mapping);
+    return keycodes;
+}
 
-    std::cout << "Started dragging window " << window << std::endl;
+void end_focus_cycle(xcb_connection_t* conn) {
+    mru_cycle.active = false;
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    if (focused_client_window != XCB_WINDOW_NONE) {
+        mru_touch(focused_client_window);
+    }
 }
 
-void start_resize(xcb_connection_t* conn, xcb_window_t window, int pointer_x, int pointer_y) {
-    if (!is_floating(window)) return;
+void cycle_focus(xcb_connection_t* conn, const KeyBinding& binding) {
+    if (workspaces[current_workspace].mru_head == XCB_WINDOW_NONE) return;
+    bool starting = !mru_cycle.active;
+    if (starting) {
+        // The keyboard is held until the modifier goes up, so its release reaches swm.
+        xcb_grab_keyboard_reply_t* grab = xcb_grab_keyboard_reply(conn,
+            xcb_grab_keyboard(conn, 0, screen->root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC), nullptr);
+        bool grabbed = grab && grab->status == XCB_GRAB_STATUS_SUCCESS;
+        free(grab);
+        if (!grabbed) {
+            focus_last(conn);
+            return;
+        }
+        mru_cycle.active = true;
+        mru_cycle.modifiers = binding.modifiers & ~XCB_MOD_MASK_SHIFT;
+        mru_cycle.release_keys = modifier_keycodes(conn, mru_cycle.modifiers);
+        xcb_window_t head = workspaces[current_workspace].mru_head;
+        mru_cycle.position = head == focused_client_window ? head : (xcb_window_t)XCB_WINDOW_NONE;
+    }
+    mru_cycle.position = mru_step(mru_cycle.position, binding.action == Action::FocusCycle);
+    focus_client(conn, mru_cycle.position);
+    if (starting) {
+        // A modifier released before the grab took effect went to the client;
+        // without this check the grab would never end.
+        xcb_query_pointer_reply_t* pointer = xcb_query_pointer_reply(conn, xcb_query_pointer(conn, screen->root), nullptr);
+        bool held = !pointer || (pointer->mask & mru_cycle.modifiers) == mru_cycle.modifiers;
+        free(pointer);
+        if (!held || mru_cycle.release_keys.empty()) {
+            end_focus_cycle(conn);
+        }
+    }
+}
 
-    drag_state.is_resizing = true;
-    drag_state.dragged_window = window;
-    drag_state.start_x = pointer_x;
-    drag_state.start_y = pointer_y;
+// Ends a Super+Tab walk once one of its modifiers is released.
+void handle_cycle_release(xcb_connection_t* conn, xcb_keycode_t keycode) {
+    if (!mru_cycle.active) return;
+    if (std::ranges::find(mru_cycle.release_keys, keycode) == mru_cycle.release_keys.end()) return;
+    end_focus_cycle(conn);
+}
 
-    get_window_geometry(conn, window, &drag_state.start_win_x, &drag_state.start_win_y,
-                       &drag_state.start_width, &drag_state.start_height);
+// Runs at the end of the event batch after the focused window was destroyed.
+void apply_focus_fallback(xcb_connection_t* conn) {
+    if (!focus_fallback_pending) return;
+    focus_fallback_pending = false;
+    if (focused_client_window != XCB_WINDOW_NONE) return;
+    focus_client(conn, get_current_focused());
+}
 
-    xcb_grab_pointer(conn, 0, window,
-                    XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
-                    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
-                    XCB_WINDOW_NONE, XCB_CURSOR_NONE, XCB_CURRENT_TIME);
+// Creates the shared-memory segment; swm runs fine without it.
+void open_state_export() {
+    int fd = shm_open(SWM_STATE_NAME, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(swm_state)) < 0) {
+        std::cerr << "Not exporting state to " << SWM_STATE_NAME << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    void* mapping = mmap(nullptr, sizeof(swm_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Not exporting state to " << SWM_STATE_NAME << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    state_export = (swm_state*)mapping;
+    // A segment left over from a crashed swm may hold an odd sequence.
+    uint32_t sequence = __atomic_load_n(&state_export->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_export->sequence, (sequence + 1) & ~1u, __ATOMIC_RELEASE);
+    state_export->magic = SWM_STATE_MAGIC;
+    state_export->version = SWM_STATE_VERSION;
+}
 
-    std::cout << "Started resizing window " << window << std::endl;
+void close_state_export() {
+    if (!state_export) return;
+    munmap(state_export, sizeof(swm_state));
+    state_export = nullptr;
+    shm_unlink(SWM_STATE_NAME);
 }
 
-void update_drag(xcb_connection_t* conn, int pointer_x, int pointer_y) {
-    if (!drag_state.is_dragging && !drag_state.is_resizing) return;
+void export_window(swm_state& state, xcb_window_t window, int workspace_id) {
+    auto client = clients.find(window);
+    if (client == clients.end()) return;
+    state.total_window_count++;
+    if (state.window_count >= SWM_STATE_MAX_WINDOWS) return;
+    const Client& data = client->second;
+    swm_state_window& entry = state.windows[state.window_count++];
+    entry.window = window;
+    entry.workspace = workspace_id;
+    entry.flags = (is_floating(window) ? SWM_STATE_FLOATING : 0) |
+                  (data.fullscreen ? SWM_STATE_FULLSCREEN : 0) |
+                  (workspace_id < 0 ? SWM_STATE_SCRATCHPAD : 0) |
+                  (data.hidden ? SWM_STATE_HIDDEN : 0);
+    entry.x = data.x;
+    entry.y = data.y;
+    entry.width = data.width;
+    entry.height = data.height;
+    auto copy = [](char* out, size_t size, std::string_view text) {
+        size_t length = std::min(text.size(), size - 1);
+        memcpy(out, text.data(), length);
+        out[length] = '\0';
+    };
+    copy(entry.wm_class, sizeof(entry.wm_class), data.wm_class.view());
+    copy(entry.title, sizeof(entry.title), data.title.view());
+}
 
-    if (drag_state.is_dragging) {
-        int new_x = drag_state.start_win_x + (pointer_x - drag_state.start_x);
-        int new_y = drag_state.start_win_y + (pointer_y - drag_state.start_y);
+// Runs at the end of the event batch. The sequence is odd while the snapshot
+// is being rewritten, so readers retry instead of seeing a torn copy.
+void write_state_export() {
+    if (!state_export || !state_export_dirty) return;
+    state_export_dirty = false;
+    swm_state& state = *state_export;
+    uint32_t sequence = __atomic_load_n(&state.sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&state.sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    state.current_workspace = current_workspace;
+    state.focused_window = focused_client_window;
+    state.gap_size = gap_size;
+    state.master_ratio = master_ratio;
+    state.work_area_x = work_area.x;
+    state.work_area_y = work_area.y;
+    state.work_area_width = work_area.width;
+    state.work_area_height = work_area.height;
+    state.workspace_count = 0;
+    state.window_count = 0;
+    state.total_workspace_count = workspaces.size();
+    state.total_window_count = 0;
+    for (const auto& [id, workspace] : workspaces) {
+        if (state.workspace_count < SWM_STATE_MAX_WORKSPACES) {
+            swm_state_workspace& entry = state.workspaces[state.workspace_count++];
+            entry.id = id;
+            entry.window_count = workspace.windows.size();
+            entry.focused_window = workspace.focused_window;
+            entry.fullscreen_window = workspace.fullscreen_window;
+        }
+        for (xcb_window_t window : workspace.windows) {
+            export_window(state, window, id);
+        }
+    }
+    for (const Scratchpad& scratchpad : scratchpads) {
+        export_window(state, scratchpad.window, -1);
+    }
 
-        uint32_t values[2] = {(uint32_t)new_x, (uint32_t)new_y};
-        xcb_configure_window(conn, drag_state.dragged_window,
-                           XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, values);
-    } else if (drag_state.is_resizing) {
-        int new_width = std::max(100, drag_state.start_width + (pointer_x - drag_state.start_x));
-        int new_height = std::max(100, drag_state.start_height + (pointer_y - drag_state.start_y));
+    __atomic_store_n(&state.sequence, sequence + 2, __ATOMIC_RELEASE);
+}
 
-        uint32_t values[2] = {(uint32_t)new_width, (uint32_t)new_height};
-        xcb_configure_window(conn, drag_state.dragged_window,
-                           XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+// Returns false when the binding asks swm to quit.
+bool run_key_binding(xcb_connection_t* conn, xcb_screen_t* screen, const KeyBinding& binding) {
+    switch (binding.action) {
+        case Action::Spawn:
+            spawn(binding.command.c_str());
+            break;
+        case Action::Quit:
+            return false;
+        case Action::Kill:
+            if (focused_client_window != XCB_WINDOW_NONE && focused_client_window != screen->root) {
+                kill_client(conn, focused_client_window);
+            }
+            break;
+        case Action::ToggleFloating:
+            if (get_current_focused() != XCB_WINDOW_NONE) {
+                toggle_floating(conn, screen, get_current_focused());
+            }
+            break;
+        case Action::ToggleFullscreen: {
+            xcb_window_t focused = get_current_focused();
+            if (focused != XCB_WINDOW_NONE) {
+                set_fullscreen(conn, screen, focused, workspaces[current_workspace].fullscreen_window != focused);
+            }
+            break;
+        }
+        case Action::FocusNext:
+        case Action::FocusPrev:
+            focus_next_in_stack(conn, binding.action == Action::FocusNext);
+            break;
+        case Action::MoveDown:
+        case Action::MoveUp:
+            move_window_in_stack(conn, binding.action == Action::MoveUp);
+            break;
+        case Action::GapIncrease:
+            gap_size += 2;
+            apply_master_stack(conn);
+            break;
+        case Action::GapDecrease:
+            gap_size = std::max(0, gap_size - 2);
+            apply_master_stack(conn);
+            break;
+        case Action::RatioDecrease:
+            master_ratio = std::max(0.1f, master_ratio - 0.05f);
+            apply_master_stack(conn);
+            break;
+        case Action::RatioIncrease:
+            master_ratio = std::min(0.9f, master_ratio + 0.05f);
+            apply_master_stack(conn);
+            break;
+        case Action::Workspace:
+            switch_workspace(conn, screen, binding.argument);
+            break;
+        case Action::MoveToWorkspace:
+            if (get_current_focused() != XCB_WINDOW_NONE) {
+                move_window_to_workspace(conn, screen, get_current_focused(), binding.argument);
+            }
+            break;
+        case Action::ToggleScratchpad:
+            toggle_scratchpad(conn, screen, scratchpads[binding.argument]);
+            break;
+        case Action::AssignScratchpad:
+            assign_scratchpad(conn, screen, scratchpads[binding.argument], get_current_focused());
+            break;
+        case Action::FocusLast:
+            focus_last(conn);
+            break;
+        case Action::WorkspaceNext:
+        case Action::WorkspacePrev:
+            switch_workspace(conn, screen, adjacent_workspace(binding.action == Action::WorkspaceNext));
+            break;
+        case Action::WorkspaceNew:
+            switch_workspace(conn, screen, first_free_workspace());
+            break;
+        case Action::FocusCycle:
+        case Action::FocusCycleBack:
+            cycle_focus(conn, binding);
+            break;
     }
-    xcb_flush(conn);
+    return true;
 }
 
-void end_drag(xcb_connection_t* conn) {
-    if (drag_state.is_dragging || drag_state.is_resizing) {
-        xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
-        std::cout << "Finished " << (drag_state.is_dragging ? "dragging" : "resizing")
-                  << " window " << drag_state.dragged_window << std::endl;
+// Switches to a new configuration, touching only what differs from the old one.
+void apply_config(xcb_connection_t* conn, xcb_screen_t* screen, std::shared_ptr<const Config> next) {
+    std::shared_ptr<const Config> previous = std::move(config);
+    config = std::move(next);
+
+    auto has_key = [](const Config& in, const KeyBinding& binding) {
+        return std::any_of(in.bindings.begin(), in.bindings.end(),
+                           [&](const KeyBinding& other) { return other.same_key(binding); });
+    };
+    for (const KeyBinding& binding : previous ? previous->bindings : std::vector<KeyBinding>{}) {
+        if (!has_key(*config, binding)) ungrab_key_with_mods(conn, screen->root, binding.keycode, binding.modifiers);
+    }
+    for (const KeyBinding& binding : config->bindings) {
+        if (!previous || !has_key(*previous, binding)) grab_key_with_mods(conn, screen->root, binding.keycode, binding.modifiers);
     }
 
-    drag_state.is_dragging = false;
-    drag_state.is_resizing = false;
-    drag_state.dragged_window = XCB_WINDOW_NONE;
+    if (!previous || previous->focused_border != config->focused_border || previous->unfocused_border != config->unfocused_border) {
+        focused_border = get_color_pixel(conn, screen, config->focused_border.red, config->focused_border.green, config->focused_border.blue);
+        unfocused_border = get_color_pixel(conn, screen, config->unfocused_border.red, config->unfocused_border.green, config->unfocused_border.blue);
+        if (previous) {
+            for (const auto& [window, client] : clients) {
+                uint32_t* pixel = window == focused_client_window ? &focused_border : &unfocused_border;
+                track_request(xcb_change_window_attributes(conn, window, XCB_CW_BORDER_PIXEL, pixel), window);
+            }
+        }
+    }
+
+    if (previous && previous->focus_follows_mouse != config->focus_follows_mouse) {
+        uint32_t client_mask = client_event_mask();
+        for (const auto& [window, client] : clients) {
+            track_request(xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK, &client_mask), window);
+        }
+    }
+
+    // Values adjusted at runtime with the gap/ratio keys survive reloads that don't change them.
+    bool relayout = false;
+    if (!previous || previous->gap_size != config->gap_size) {
+        gap_size = config->gap_size;
+        relayout = true;
+    }
+    if (!previous || previous->master_ratio != config->master_ratio) {
+        master_ratio = config->master_ratio;
+        relayout = true;
+    }
+    if (previous && relayout) {
+        apply_master_stack(conn);
+    }
     xcb_flush(conn);
 }
 
-void update_client_list(xcb_connection_t* conn, xcb_screen_t* screen) {
-    std::vector<xcb_window_t> all_windows;
-    for (int i = 0; i < MAX_WORKSPACES; ++i) {
-        all_windows.insert(all_windows.end(), workspaces[i].windows.begin(), workspaces[i].windows.end());
+void handle_config_change(xcb_connection_t* conn, xcb_screen_t* screen) {
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t length;
+    std::string_view file_name = std::string_view(config_path).substr(config_path.rfind('/') + 1);
+    while ((length = read(config_inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char* position = buffer; position < buffer + length;) {
+            auto* notify = (inotify_event*)position;
+            if (notify->len && file_name == notify->name) changed = true;
+            position += sizeof(inotify_event) + notify->len;
+        }
+    }
+    if (!changed) return;
+    if (std::shared_ptr<const Config> next = load_config()) {
+        std::cout << "Reloading " << config_path << std::endl;
+        apply_config(conn, screen, std::move(next));
     }
-    xcb_change_property(
-        conn,
-        XCB_PROP_MODE_REPLACE,
-        screen->root,
-        ewmh._NET_CLIENT_LIST,
-        XCB_ATOM_WINDOW,
-        32,
-        all_windows.size(),
-        all_windows.data()
-    );
-    xcb_change_property(
-        conn,
-        XCB_PROP_MODE_REPLACE,
-        screen->root,
-        ewmh._NET_CLIENT_LIST_STACKING,
-        XCB_ATOM_WINDOW,
-        32,
-        all_windows.size(),
-        all_windows.data()
-    );
 }
 
-
 int main() {
     xcb_connection_t* connection;
     xcb_generic_event_t* event = nullptr;
@@ -511,6 +3311,7 @@ int main() {
         return 1;
     }
     std::cout << "Connected to X server" << std::endl;
+    open_trace();
 
     const xcb_setup_t* setup = xcb_get_setup(connection);
     screen = xcb_setup_roots_iterator(setup).data;
@@ -521,14 +3322,26 @@ int main() {
     ewmh._NET_ACTIVE_WINDOW = get_atom(connection, "_NET_ACTIVE_WINDOW");
     ewmh._NET_WM_STATE = get_atom(connection, "_NET_WM_STATE");
     ewmh._NET_WM_STATE_FULLSCREEN = get_atom(connection, "_NET_WM_STATE_FULLSCREEN");
+    ewmh._NET_WM_STATE_HIDDEN = get_atom(connection, "_NET_WM_STATE_HIDDEN");
     ewmh._NET_WM_WINDOW_TYPE = get_atom(connection, "_NET_WM_WINDOW_TYPE");
     ewmh._NET_WM_WINDOW_TYPE_DIALOG = get_atom(connection, "_NET_WM_WINDOW_TYPE_DIALOG");
+    ewmh._NET_WM_WINDOW_TYPE_DOCK = get_atom(connection, "_NET_WM_WINDOW_TYPE_DOCK");
     ewmh._NET_CLIENT_LIST = get_atom(connection, "_NET_CLIENT_LIST");
     ewmh._NET_CLIENT_LIST_STACKING = get_atom(connection, "_NET_CLIENT_LIST_STACKING");
     ewmh._NET_WM_DESKTOP = get_atom(connection, "_NET_WM_DESKTOP");
     ewmh._NET_WM_NAME = get_atom(connection, "_NET_WM_NAME");
     ewmh._NET_DESKTOP_NAMES = get_atom(connection, "_NET_DESKTOP_NAMES");
     ewmh._NET_WORKAREA = get_atom(connection, "_NET_WORKAREA");
+    ewmh._NET_WM_PID = get_atom(connection, "_NET_WM_PID");
+    ewmh._NET_WM_STRUT = get_atom(connection, "_NET_WM_STRUT");
+    ewmh._NET_WM_STRUT_PARTIAL = get_atom(connection, "_NET_WM_STRUT_PARTIAL");
+    ewmh._NET_WM_SYNC_REQUEST = get_atom(connection, "_NET_WM_SYNC_REQUEST");
+    ewmh._NET_WM_SYNC_REQUEST_COUNTER = get_atom(connection, "_NET_WM_SYNC_REQUEST_COUNTER");
+    swm_atoms.UTF8_STRING = get_atom(connection, "UTF8_STRING");
+    swm_atoms.WM_PROTOCOLS = get_atom(connection, "WM_PROTOCOLS");
+    swm_atoms._SWM_CLIENT_INFO = get_atom(connection, "_SWM_CLIENT_INFO");
+    swm_atoms._SWM_SWITCH_QUERY = get_atom(connection, "_SWM_SWITCH_QUERY");
+    swm_atoms._SWM_FROZEN_PROCESSES = get_atom(connection, "_SWM_FROZEN_PROCESSES");
     std::vector<xcb_atom_t> supported_atoms = {
         ewmh._NET_SUPPORTED,
         ewmh._NET_NUMBER_OF_DESKTOPS,
@@ -536,14 +3349,20 @@ int main() {
         ewmh._NET_ACTIVE_WINDOW,
         ewmh._NET_WM_STATE,
         ewmh._NET_WM_STATE_FULLSCREEN,
+        ewmh._NET_WM_STATE_HIDDEN,
         ewmh._NET_WM_WINDOW_TYPE,
         ewmh._NET_WM_WINDOW_TYPE_DIALOG,
+        ewmh._NET_WM_WINDOW_TYPE_DOCK,
         ewmh._NET_CLIENT_LIST,
         ewmh._NET_CLIENT_LIST_STACKING,
         ewmh._NET_WM_DESKTOP,
         ewmh._NET_WM_NAME,
         ewmh._NET_DESKTOP_NAMES,
-        ewmh._NET_WORKAREA
+        ewmh._NET_WORKAREA,
+        ewmh._NET_WM_PID,
+        ewmh._NET_WM_STRUT,
+        ewmh._NET_WM_STRUT_PARTIAL,
+        ewmh._NET_WM_SYNC_REQUEST
     };
     xcb_change_property(
         connection,
@@ -555,37 +3374,56 @@ int main() {
         supported_atoms.size(),
         supported_atoms.data()
     );
-    uint32_t num_desktops = MAX_WORKSPACES;
-    xcb_change_property(
-        connection,
-        XCB_PROP_MODE_REPLACE,
-        screen->root,
-        ewmh._NET_NUMBER_OF_DESKTOPS,
-        XCB_ATOM_CARDINAL,
-        32,
-        1,
-        &num_desktops
-    );
-    uint32_t workarea[4] = {
-        (uint32_t)gap_size,
-        (uint32_t)gap_size,
-        (uint32_t)(screen->width_in_pixels - 2 * gap_size),
-        (uint32_t)(screen->height_in_pixels - 2 * gap_size)
-    };
-    xcb_change_property(
-        connection,
-        XCB_PROP_MODE_REPLACE,
-        screen->root,
-        ewmh._NET_WORKAREA,
-        XCB_ATOM_CARDINAL,
-        32,
-        4,
-        workarea
-    );
+    workspace_at(current_workspace);
+    work_area = { 0, 0, screen->width_in_pixels, screen->height_in_pixels };
+    publish_desktops(connection, screen);
     update_client_list(connection, screen);
 
-    focused_border = get_color_pixel(connection, screen, 65535, 42405, 0);
-    unfocused_border = get_color_pixel(connection, screen, 30000, 30000, 30000);
+    if (const char* path = getenv("SWM_CONFIG")) {
+        config_path = path;
+    } else if (const char* xdg_config = getenv("XDG_CONFIG_HOME")) {
+        config_path = std::string(xdg_config) + "/swm/swmrc";
+    } else {
+        config_path = std::string(getenv("HOME") ? getenv("HOME") : "") + "/.config/swm/swmrc";
+    }
+    std::shared_ptr<const Config> initial_config = load_config();
+    if (!initial_config) {
+        std::cerr << "Falling back to the default configuration" << std::endl;
+        initial_config = default_config();
+    }
+    // Editors usually replace the file, so watch the directory rather than the file.
+    config_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    std::string config_dir = config_path.substr(0, config_path.rfind('/'));
+    if (inotify_add_watch(config_inotify_fd, config_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+        std::cerr << "Not watching " << config_dir << " for config changes: " << strerror(errno) << std::endl;
+    }
+
+    wireframe_gc = xcb_generate_id(connection);
+    uint32_t gc_values[4] = {
+        XCB_GX_XOR,
+        screen->white_pixel ^ screen->black_pixel,
+        2,
+        XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS
+    };
+    xcb_create_gc(connection, wireframe_gc, screen->root,
+                  XCB_GC_FUNCTION | XCB_GC_FOREGROUND | XCB_GC_LINE_WIDTH | XCB_GC_SUBWINDOW_MODE, gc_values);
+    drag_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    sync_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    init_sync_extension(connection);
+    resource_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (resource_sample_interval_ms > 0) {
+        itimerspec spec{};
+        spec.it_interval.tv_sec = resource_sample_interval_ms / 1000;
+        spec.it_interval.tv_nsec = (resource_sample_interval_ms % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(resource_timer_fd, 0, &spec, nullptr);
+    }
+    // SIGUSR1 prints the per-client resource table.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
 
     if (screen) {
         std::cout << screen->width_in_pixels << "x" << screen->height_in_pixels << std::endl;
@@ -597,7 +3435,8 @@ int main() {
                XCB_EVENT_MASK_BUTTON_PRESS |
                XCB_EVENT_MASK_BUTTON_RELEASE |
                XCB_EVENT_MASK_POINTER_MOTION |
-               XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+               XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY |
+               XCB_EVENT_MASK_PROPERTY_CHANGE;
 
         xcb_change_window_attributes(connection, screen->root, XCB_CW_EVENT_MASK, &mask);
         xcb_generic_error_t *error = xcb_request_check(connection, xcb_change_window_attributes_checked(connection, screen->root, XCB_CW_EVENT_MASK, &mask));
@@ -607,18 +3446,13 @@ int main() {
             xcb_disconnect(connection);
             return 1;
         }
+        // Only once the root is ours, so a second swm leaves the running one's segment alone.
+        open_state_export();
 
         uint16_t modmask_super = XCB_MOD_MASK_4;
         uint16_t num_lock_mask = XCB_MOD_MASK_2;
         uint16_t caps_lock_mask = XCB_MOD_MASK_LOCK;
 
-        auto grab_key_with_mods = [&](xcb_keycode_t keycode, uint16_t modifiers) {
-            xcb_grab_key(connection, 1, screen->root, modifiers, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-            xcb_grab_key(connection, 1, screen->root, modifiers | num_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-            xcb_grab_key(connection, 1, screen->root, modifiers | caps_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-            xcb_grab_key(connection, 1, screen->root, modifiers | num_lock_mask | caps_lock_mask, keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
-        };
-
         auto grab_button_with_mods = [&](xcb_button_index_t button, uint16_t modifiers) {
             xcb_grab_button(connection, 0, screen->root,
                           XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
@@ -638,100 +3472,120 @@ int main() {
                           XCB_WINDOW_NONE, XCB_CURSOR_NONE, button, modifiers | num_lock_mask | caps_lock_mask);
         };
 
-        grab_key_with_mods(KEYCODE_RETURN, modmask_super);
-        grab_key_with_mods(KEYCODE_SPACE, modmask_super);
-        grab_key_with_mods(KEYCODE_ESCAPE, modmask_super);
-        grab_key_with_mods(KEYCODE_Q, modmask_super);
-        grab_key_with_mods(KEYCODE_W, modmask_super);
-        grab_key_with_mods(KEYCODE_H, modmask_super);
-        grab_key_with_mods(KEYCODE_J, modmask_super);
-        grab_key_with_mods(KEYCODE_K, modmask_super);
-        grab_key_with_mods(KEYCODE_L, modmask_super);
-        grab_key_with_mods(KEYCODE_D, modmask_super);
-        grab_key_with_mods(KEYCODE_PLUS, modmask_super);
-        grab_key_with_mods(KEYCODE_MINUS, modmask_super);
-        grab_key_with_mods(KEYCODE_1, modmask_super);
-        grab_key_with_mods(KEYCODE_2, modmask_super);
-        grab_key_with_mods(KEYCODE_3, modmask_super);
-        grab_key_with_mods(KEYCODE_4, modmask_super);
-        grab_key_with_mods(KEYCODE_5, modmask_super);
-        grab_key_with_mods(KEYCODE_6, modmask_super);
-        grab_key_with_mods(KEYCODE_7, modmask_super);
-        grab_key_with_mods(KEYCODE_8, modmask_super);
-        grab_key_with_mods(KEYCODE_9, modmask_super);
-        grab_key_with_mods(KEYCODE_J, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_K, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_1, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_2, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_3, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_4, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_5, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_6, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_7, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_8, modmask_super | XCB_MOD_MASK_SHIFT);
-        grab_key_with_mods(KEYCODE_9, modmask_super | XCB_MOD_MASK_SHIFT);
+        apply_config(connection, screen, std::move(initial_config));
 
         grab_button_with_mods(XCB_BUTTON_INDEX_1, modmask_super);
         grab_button_with_mods(XCB_BUTTON_INDEX_3, modmask_super);
 
+        adopt_existing_windows(connection, screen);
+
         xcb_flush(connection);
 
-        while ((event = xcb_wait_for_event(connection))) {
+        pollfd poll_fds[] = {
+            { xcb_get_file_descriptor(connection), POLLIN, 0 },
+            { drag_timer_fd, POLLIN, 0 },
+            { resource_timer_fd, POLLIN, 0 },
+            { signal_fd, POLLIN, 0 },
+            { config_inotify_fd, POLLIN, 0 },
+            { sync_timer_fd, POLLIN, 0 },
+        };
+        while (true) {
+            event = xcb_poll_for_event(connection);
+            if (!event) {
+                if (xcb_connection_has_error(connection)) break;
+                // Event queue drained: flush and sleep until X or a timer wakes us.
+                {
+                    TraceSpan batch_span("batch_end");
+                    apply_focus_fallback(connection);
+                    apply_stacking(connection, screen);
+                    refresh_client_metadata(connection);
+                    publish_client_info(connection, screen);
+                    publish_frozen_processes(connection, screen);
+                    publish_desktops(connection, screen);
+                    write_state_export();
+                    TraceSpan flush_span("flush");
+                    xcb_flush(connection);
+                }
+                if (poll(poll_fds, std::size(poll_fds), -1) < 0 && errno != EINTR) break;
+                if (poll_fds[1].revents & POLLIN) {
+                    handle_drag_timer(connection);
+                }
+                if (poll_fds[2].revents & POLLIN) {
+                    sample_client_resources();
+                }
+                if (poll_fds[3].revents & POLLIN) {
+                    handle_signal();
+                }
+                if (poll_fds[4].revents & POLLIN) {
+                    handle_config_change(connection, screen);
+                }
+                if (poll_fds[5].revents & POLLIN) {
+                    handle_sync_timer(connection);
+                }
+                continue;
+            }
 
+            TraceSpan dispatch_span(x_event_name(event->response_type & ~0x80), x_event_window(event));
             switch (event->response_type & ~0x80) {
+                case 0: {
+                    handle_x_error(connection, screen, (xcb_generic_error_t*)event);
+                    break;
+                }
+
                 case XCB_MAP_REQUEST: {
                     auto* mr = (xcb_map_request_event_t*)event;
-                    xcb_get_window_attributes_cookie_t attr_cookie = xcb_get_window_attributes(connection, mr->window);
-                    xcb_get_window_attributes_reply_t* attr_reply = xcb_get_window_attributes_reply(connection, attr_cookie, nullptr);
-                    if (attr_reply && attr_reply->override_redirect) {
-                        free(attr_reply);
-                        xcb_map_window(connection, mr->window);
+                    if (auto managed = clients.find(mr->window); managed != clients.end()) {
+                        // The client withdrew the window and maps it again; it keeps its place.
+                        managed->second.events.maps++;
+                        Scratchpad* scratchpad = find_scratchpad(mr->window);
+                        if (scratchpad ? scratchpad->visible : find_workspace_of(mr->window) == current_workspace) {
+                            track_request(xcb_map_window(connection, mr->window), mr->window);
+                            if (scratchpad) {
+                                place_scratchpad(connection, screen, *scratchpad);
+                            } else {
+                                apply_master_stack(connection);
+                            }
+                        }
                         xcb_flush(connection);
                         break;
                     }
-                    if (attr_reply) free(attr_reply);
-                    uint32_t values[4];
-                    uint16_t mask_config = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-                    values[0] = 0;
-                    values[1] = 0;
-                    values[2] = screen->width_in_pixels;
-                    values[3] = screen->height_in_pixels;
-                    xcb_configure_window(connection, mr->window, mask_config, values);
-
-                    uint32_t border_width = 2;
-                    xcb_configure_window(connection, mr->window, XCB_CONFIG_WINDOW_BORDER_WIDTH, &border_width);
-
-                    uint32_t client_mask = XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
-                    xcb_change_window_attributes(connection, mr->window, XCB_CW_EVENT_MASK, &client_mask);
-
-                    xcb_grab_button(connection, 0, mr->window,
-                        XCB_EVENT_MASK_BUTTON_PRESS,
-                        XCB_GRAB_MODE_SYNC,
-                        XCB_GRAB_MODE_ASYNC,
-                        XCB_WINDOW_NONE,
-                        XCB_CURSOR_NONE,
-                        XCB_BUTTON_INDEX_1,
-                        XCB_MOD_MASK_ANY);
-
-                    xcb_map_window(connection, mr->window);
-                    xcb_change_window_attributes(connection, mr->window, XCB_CW_BORDER_PIXEL, &unfocused_border);
-
-                    xcb_configure_notify_event_t configure_notify_event;
-                    configure_notify_event.response_type = XCB_CONFIGURE_NOTIFY;
-                    configure_notify_event.event = mr->window;
-                    configure_notify_event.window = mr->window;
-                    configure_notify_event.x = values[0];
-                    configure_notify_event.y = values[1];
-                    configure_notify_event.width = values[2];
-                    configure_notify_event.height = values[3];
-                    configure_notify_event.border_width = 0;
-                    configure_notify_event.above_sibling = XCB_WINDOW_NONE;
-                    configure_notify_event.override_redirect = false;
-                    xcb_send_event(connection, 0, mr->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&configure_notify_event);
+                    WindowInfo info = collect_window(connection, query_window(connection, mr->window));
+                    if (info.override_redirect || info.is_dock) {
+                        if (info.is_dock) {
+                            register_dock(connection, mr->window, info.strut);
+                            update_work_area(connection, screen);
+                        }
+                        track_request(xcb_map_window(connection, mr->window), mr->window);
+                        xcb_flush(connection);
+                        break;
+                    }
+                    info.client.events.maps++;
+                    setup_client_window(connection, screen, mr->window, std::move(info.client));
+                    track_request(xcb_map_window(connection, mr->window), mr->window);
                     xcb_flush(connection);
 
+                    if (Scratchpad* claimed = find_spawning_scratchpad(clients[mr->window].pid)) {
+                        Scratchpad& scratchpad = *claimed;
+                        scratchpad.spawned_pid = 0;
+                        scratchpad.window = mr->window;
+                        scratchpad.visible = true;
+                        uint32_t all_desktops = 0xFFFFFFFF;
+                        xcb_change_property(connection, XCB_PROP_MODE_REPLACE, mr->window, ewmh._NET_WM_DESKTOP,
+                                            XCB_ATOM_CARDINAL, 32, 1, &all_desktops);
+                        place_scratchpad(connection, screen, scratchpad);
+                        focus_client(connection, mr->window);
+                        update_client_list(connection, screen);
+                        std::cout << "Window " << mr->window << " claimed by scratchpad " << scratchpad.name << std::endl;
+                        break;
+                    }
+
+                    // A new window would be hidden behind the fullscreen one.
+                    if (workspaces[current_workspace].fullscreen_window != XCB_WINDOW_NONE) {
+                        set_fullscreen(connection, screen, workspaces[current_workspace].fullscreen_window, false);
+                    }
                     get_current_windows().push_back(mr->window);
-                    apply_master_stack(connection, screen);
+                    mru_link(mr->window, current_workspace, true);
+                    apply_master_stack(connection);
 
                     xcb_change_property(
                         connection,
@@ -745,197 +3599,98 @@ int main() {
                     );
                     update_client_list(connection, screen);
                     focus_client(connection, mr->window);
+                    if (info.wants_fullscreen) {
+                        set_fullscreen(connection, screen, mr->window, true);
+                    }
                     break;
                 }
 
                 case XCB_CONFIGURE_REQUEST: {
                     auto* cr = (xcb_configure_request_event_t*)event;
-                    uint32_t values[4];
-                    uint16_t mask_config = 0;
-                    mask_config |= XCB_CONFIG_WINDOW_X;
-                    values[0] = 0;
-                    mask_config |= XCB_CONFIG_WINDOW_Y;
-                    values[1] = 0;
-                    mask_config |= XCB_CONFIG_WINDOW_WIDTH;
-                    values[2] = screen->width_in_pixels;
-                    mask_config |= XCB_CONFIG_WINDOW_HEIGHT;
-                    values[3] = screen->height_in_pixels;
-                    xcb_configure_window(connection, cr->window, mask_config, values);
-
+                    if (auto client = clients.find(cr->window); client != clients.end()) {
+                        client->second.events.configure_requests++;
+                    }
+                    if (Scratchpad* scratchpad = find_scratchpad(cr->window)) {
+                        place_scratchpad(connection, screen, *scratchpad);
+                        xcb_flush(connection);
+                        break;
+                    }
+                    if (!clients.contains(cr->window)) {
+                        // Docks and windows that are not mapped yet get what they ask for.
+                        uint32_t requested[7];
+                        int count = 0;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_X) requested[count++] = (uint32_t)cr->x;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_Y) requested[count++] = (uint32_t)cr->y;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_WIDTH) requested[count++] = cr->width;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_HEIGHT) requested[count++] = cr->height;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) requested[count++] = cr->border_width;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_SIBLING) requested[count++] = cr->sibling;
+                        if (cr->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) requested[count++] = cr->stack_mode;
+                        track_request(xcb_configure_window(connection, cr->window, cr->value_mask, requested), cr->window);
+                        xcb_flush(connection);
+                        break;
+                    }
+                    // Managed windows are placed by the layout. The request is
+                    // refused by telling the client where it already is.
+                    const Client& client = clients[cr->window];
                     xcb_configure_notify_event_t configure_notify_event;
                     configure_notify_event.response_type = XCB_CONFIGURE_NOTIFY;
                     configure_notify_event.event = cr->window;
                     configure_notify_event.window = cr->window;
-                    configure_notify_event.x = values[0];
-                    configure_notify_event.y = values[1];
-                    configure_notify_event.width = values[2];
-                    configure_notify_event.height = values[3];
+                    configure_notify_event.x = client.x;
+                    configure_notify_event.y = client.y;
+                    configure_notify_event.width = client.width;
+                    configure_notify_event.height = client.height;
                     configure_notify_event.border_width = 0;
                     configure_notify_event.above_sibling = XCB_WINDOW_NONE;
                     configure_notify_event.override_redirect = false;
-                    xcb_send_event(connection, 0, cr->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&configure_notify_event);
+                    track_request(xcb_send_event(connection, 0, cr->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&configure_notify_event), cr->window);
 
                     xcb_flush(connection);
                     break;
                 }
 
+                case XCB_CONFIGURE_NOTIFY: {
+                    auto* cn = (xcb_configure_notify_event_t*)event;
+                    if (auto client = clients.find(cn->window); client != clients.end()) {
+                        client->second.x = cn->x;
+                        client->second.y = cn->y;
+                        client->second.width = cn->width;
+                        client->second.height = cn->height;
+                        state_export_dirty = true;
+                    }
+                    break;
+                }
+
                 case XCB_DESTROY_NOTIFY: {
                     auto* dn = (xcb_destroy_notify_event_t*)event;
-                    bool found = false;
-                    for (int i = 0; i < MAX_WORKSPACES; ++i) {
-                        auto& windows = workspaces[i].windows;
-                        auto it = std::find(windows.begin(), windows.end(), dn->window);
-                        if (it != windows.end()) {
-                            windows.erase(it);
-                            found = true;
-                            if (workspaces[i].focused_window == dn->window) {
-                                if (!windows.empty()) {
-                                    workspaces[i].focused_window = windows.back();
-                                    if (i == current_workspace) {
-                                        focus_client(connection, windows.back());
-                                    }
-                                } else {
-                                    workspaces[i].focused_window = XCB_WINDOW_NONE;
-                                    if (i == current_workspace) {
-                                        focused_client_window = XCB_WINDOW_NONE;
-                                    }
-                                }
-                            }
-                            break;
-                        }
-                    }
-                    auto float_it = std::find(floating_windows.begin(), floating_windows.end(), dn->window);
-                    if (float_it != floating_windows.end()) {
-                        floating_windows.erase(float_it);
-                    }
-                    if (found) {
-                        update_client_list(connection, screen);
-                        apply_master_stack(connection, screen);
-                    }
+                    unmanage_client(connection, screen, dn->window);
                     break;
                 }
 
                 case XCB_KEY_PRESS: {
                     auto* kp = (xcb_key_press_event_t*)event;
-                    uint16_t current_modmask = kp->state & (modmask_super | num_lock_mask | caps_lock_mask | XCB_MOD_MASK_SHIFT);
-
-                    if ((kp->detail == KEYCODE_RETURN) && (current_modmask & modmask_super)) {
-                        spawn("st");
-                    }
-                    else if ((kp->detail) == KEYCODE_D && (current_modmask & modmask_super)) {
-                        spawn("dmenu_run");
-                    }
-                    else if ((kp->detail == KEYCODE_SPACE) && (current_modmask & modmask_super)) {
-                        if (get_current_focused() != XCB_WINDOW_NONE) {
-                            toggle_floating(connection, screen, get_current_focused());
-                        }
-                    }
-                    else if ((kp->detail == KEYCODE_ESCAPE) && (current_modmask & modmask_super)) {
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_RETURN, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_ESCAPE, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_SPACE, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_D, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_Q, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_W, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_J, modmask_super);
-                        ungrab_key_with_mods(connection, screen->root, KEYCODE_K, modmask_super);
-                        uint32_t reset_mask = 0;
-                        xcb_change_window_attributes(connection, screen->root, XCB_CW_EVENT_MASK, &reset_mask);
-                        xcb_flush(connection);
-                        free(event);
-                        goto end_loop;
-                    }
-                    else if ((kp->detail == KEYCODE_Q) && (current_modmask & modmask_super)) {
-                        if (focused_client_window != XCB_WINDOW_NONE && focused_client_window != screen->root) {
-                            kill_client(connection, focused_client_window);
-                        }
-                    }
-                    else if ((kp->detail == KEYCODE_J) && (current_modmask & modmask_super) && (current_modmask & XCB_MOD_MASK_SHIFT)) {
-                        std::cout << "Move window down" << std::endl;
-                        move_window_in_stack(connection, screen, false);
-                    }
-                    else if ((kp->detail == KEYCODE_K) && (current_modmask & modmask_super) && (current_modmask & XCB_MOD_MASK_SHIFT)) {
-                        std::cout << "Move window up" << std::endl;
-                        move_window_in_stack(connection, screen, true);
-                    }
-                    else if ((kp->detail == KEYCODE_J && (current_modmask & modmask_super))) {
-                        auto& current_windows = get_current_windows();
-                        if (!current_windows.empty()) {
-                            auto it = std::find(current_windows.begin(), current_windows.end(), get_current_focused());
-                            if (it != current_windows.end()) {
-                                ++it;
-                                if (it == current_windows.end()) {
-                                    it = current_windows.begin();
-                                }
-                                focus_client(connection, *it);
-                            } else {
-                                focus_client(connection, current_windows[0]);
-                            }
-                        }
-                    }
-                    else if ((kp->detail == KEYCODE_K) && (current_modmask & modmask_super)) {
-                        auto& current_windows = get_current_windows();
-                        if (!current_windows.empty()) {
-                            auto it = std::find(current_windows.begin(), current_windows.end(), get_current_focused());
-                            if (it != current_windows.end()) {
-                                if (it == current_windows.begin()) {
-                                    it = current_windows.end() - 1;
-                                } else {
-                                    --it;
-                                }
-                                focus_client(connection, *it);
-                            } else {
-                                focus_client(connection, current_windows.back());
+                    uint16_t current_modmask = kp->state & (XCB_MOD_MASK_4 | XCB_MOD_MASK_SHIFT | XCB_MOD_MASK_CONTROL | XCB_MOD_MASK_1);
+                    for (const KeyBinding& binding : config->bindings) {
+                        if (binding.keycode != kp->detail || binding.modifiers != current_modmask) continue;
+                        if (!run_key_binding(connection, screen, binding)) {
+                            for (const KeyBinding& grabbed : config->bindings) {
+                                ungrab_key_with_mods(connection, screen->root, grabbed.keycode, grabbed.modifiers);
                             }
+                            uint32_t reset_mask = 0;
+                            xcb_change_window_attributes(connection, screen->root, XCB_CW_EVENT_MASK, &reset_mask);
+                            xcb_flush(connection);
+                            free(event);
+                            goto end_loop;
                         }
+                        break;
                     }
+                    break;
+                }
 
-                    else if ((kp->detail == KEYCODE_PLUS) && (current_modmask & modmask_super)) {
-                        gap_size += 2;
-                        apply_master_stack(connection, screen);
-                    }
-                    else if ((kp->detail == KEYCODE_MINUS) && (current_modmask & modmask_super)) {
-                        gap_size -= 2;
-                        apply_master_stack(connection, screen);
-                    }
-                    else if ((kp->detail == KEYCODE_H) && (current_modmask & modmask_super)) {
-                        master_ratio = std::max(0.1f, master_ratio - 0.05f);
-                        apply_master_stack(connection, screen);
-                    }
-                    else if ((kp->detail == KEYCODE_L) && (current_modmask & modmask_super)) {
-                        master_ratio = std::min(0.9f, master_ratio + 0.05f);
-                        apply_master_stack(connection, screen);
-                    }
-                    else if ((current_modmask & modmask_super) && !(current_modmask & XCB_MOD_MASK_SHIFT)) {
-                        int target_workspace = -1;
-                        if (kp->detail == KEYCODE_1) target_workspace = 0;
-                        else if (kp->detail == KEYCODE_2) target_workspace = 1;
-                        else if (kp->detail == KEYCODE_3) target_workspace = 2;
-                        else if (kp->detail == KEYCODE_4) target_workspace = 3;
-                        else if (kp->detail == KEYCODE_5) target_workspace = 4;
-                        else if (kp->detail == KEYCODE_6) target_workspace = 5;
-                        else if (kp->detail == KEYCODE_7) target_workspace = 6;
-                        else if (kp->detail == KEYCODE_8) target_workspace = 7;
-                        else if (kp->detail == KEYCODE_9) target_workspace = 8;
-                        if (target_workspace != -1) {
-                            switch_workspace(connection, screen, target_workspace);
-                        }
-                    }
-                    else if ((current_modmask & modmask_super) && (current_modmask & XCB_MOD_MASK_SHIFT)) {
-                        int target_workspace = -1;
-                        if (kp->detail == KEYCODE_1) target_workspace = 0;
-                        else if (kp->detail == KEYCODE_2) target_workspace = 1;
-                        else if (kp->detail == KEYCODE_3) target_workspace = 2;
-                        else if (kp->detail == KEYCODE_4) target_workspace = 3;
-                        else if (kp->detail == KEYCODE_5) target_workspace = 4;
-                        else if (kp->detail == KEYCODE_6) target_workspace = 5;
-                        else if (kp->detail == KEYCODE_7) target_workspace = 6;
-                        else if (kp->detail == KEYCODE_8) target_workspace = 7;
-                        else if (kp->detail == KEYCODE_9) target_workspace = 8;
-                        if (target_workspace != -1 && get_current_focused() != XCB_WINDOW_NONE) {
-                            move_window_to_workspace(connection, screen, get_current_focused(), target_workspace);
-                        }
-                    }
+                case XCB_KEY_RELEASE: {
+                    auto* kr = (xcb_key_release_event_t*)event;
+                    handle_cycle_release(connection, kr->detail);
                     break;
                 }
 
@@ -964,15 +3719,8 @@ int main() {
 
                         if (pointer_reply) free(pointer_reply);
                     } else {
-                        bool is_client_window = false;
-                        auto& current_windows = get_current_windows();
-                        for (xcb_window_t client_win : current_windows) {
-                            if (client_win == bp->event) {
-                                is_client_window = true;
-                                break;
-                            }
-                        }
-                        if (is_client_window && bp->event != get_current_focused()) {
+                        // Only unfocused clients are grabbed, so this is a click that focuses one.
+                        if (find_scratchpad(bp->event) || find_workspace_of(bp->event) == current_workspace) {
                             focus_client(connection, bp->event);
                         }
                         xcb_allow_events(connection, XCB_ALLOW_REPLAY_POINTER, bp->time);
@@ -981,6 +3729,17 @@ int main() {
                     break;
                 }
 
+                case XCB_ENTER_NOTIFY: {
+                    auto* en = (xcb_enter_notify_event_t*)event;
+                    // Grab transitions and moves out of a child window are not the pointer entering a client.
+                    if (!config->focus_follows_mouse || en->mode != XCB_NOTIFY_MODE_NORMAL || en->detail == XCB_NOTIFY_DETAIL_INFERIOR) break;
+                    if (drag_state.is_dragging || drag_state.is_resizing || mru_cycle.active) break;
+                    if (find_scratchpad(en->event) || find_workspace_of(en->event) == current_workspace) {
+                        focus_client(connection, en->event);
+                    }
+                    break;
+                }
+
                 case XCB_BUTTON_RELEASE: {
                     auto* br = (xcb_button_release_event_t *)event;
                     if (drag_state.is_dragging || drag_state.is_resizing) {
@@ -997,8 +3756,47 @@ int main() {
                     break;
                 }
 
+                case XCB_PROPERTY_NOTIFY: {
+                    auto* pn = (xcb_property_notify_event_t*)event;
+                    // Everything except a strut change is ignored here and never relayouts.
+                    if ((pn->atom == ewmh._NET_WM_STRUT_PARTIAL || pn->atom == ewmh._NET_WM_STRUT) && docks.contains(pn->window)) {
+                        refresh_dock_strut(connection, screen, pn->window);
+                    } else if (pn->atom == ewmh._NET_WM_NAME || pn->atom == XCB_ATOM_WM_NAME || pn->atom == XCB_ATOM_WM_CLASS) {
+                        // Fetched together with every other change at the end of the batch.
+                        queue_metadata_refresh(pn->window);
+                    } else if (pn->window == screen->root && pn->atom == swm_atoms._SWM_SWITCH_QUERY &&
+                               pn->state == XCB_PROPERTY_NEW_VALUE) {
+                        handle_switch_query(connection, screen);
+                    }
+                    break;
+                }
+
+                case XCB_UNMAP_NOTIFY: {
+                    auto* un = (xcb_unmap_notify_event_t*)event;
+                    // Delivered to both the root and the window itself; count it once.
+                    if (un->event != un->window) break;
+                    // An auto-hiding or withdrawn bar gives its space back; it is
+                    // registered again when it maps.
+                    if (forget_dock(connection, screen, un->window)) break;
+                    if (auto client = clients.find(un->window); client != clients.end()) {
+                        if (client->second.expected_unmaps > 0) {
+                            client->second.expected_unmaps--;
+                        } else {
+                            client->second.events.unmaps++;
+                        }
+                    }
+                    break;
+                }
+
                 case XCB_FOCUS_IN: {
                     xcb_focus_in_event_t* fi = reinterpret_cast<xcb_focus_in_event_t *>(event);
+                    // Focus swm gave the window itself is not the client's doing, and
+                    // Pointer/Inferior details are side effects of another focus change.
+                    bool client_caused = fi->event != focused_client_window &&
+                                         fi->detail != XCB_NOTIFY_DETAIL_POINTER && fi->detail != XCB_NOTIFY_DETAIL_INFERIOR;
+                    if (auto client = clients.find(fi->event); client != clients.end() && client_caused) {
+                        client->second.events.focus_changes++;
+                    }
                     auto& current_windows = get_current_windows();
 
                     bool is_client = false;
@@ -1010,7 +3808,9 @@ int main() {
                     }
 
                     if (is_client && fi->event != focused_client_window) {
-                        focused_client_window = fi->event;
+                        // The client took focus itself; swm follows so actions and MRU apply to it.
+                        mark_focused(connection, fi->event);
+                        xcb_flush(connection);
                     }
                     break;
                 }
@@ -1018,31 +3818,34 @@ int main() {
                 case XCB_CLIENT_MESSAGE: {
                     auto* cm = (xcb_client_message_event_t*)event;
 
-                    if (cm->type == ewmh._NET_CURRENT_DESKTOP) {
+                    if (cm->type == ewmh._NET_WM_STATE) {
+                        // data32[0] is the action (0 remove, 1 add, 2 toggle), [1] and [2] the properties.
+                        uint32_t action = cm->data.data32[0];
+                        if (cm->data.data32[1] == ewmh._NET_WM_STATE_FULLSCREEN || cm->data.data32[2] == ewmh._NET_WM_STATE_FULLSCREEN) {
+                            auto client = clients.find(cm->window);
+                            if (client != clients.end()) {
+                                bool enable = action == 2 ? !client->second.fullscreen : action == 1;
+                                set_fullscreen(connection, screen, cm->window, enable);
+                            }
+                        }
+                    }
+                    else if (cm->type == ewmh._NET_CURRENT_DESKTOP) {
                         uint32_t new_desktop = cm->data.data32[0];
-                        if (new_desktop < MAX_WORKSPACES) {
+                        if (new_desktop < WORKSPACE_LIMIT) {
                             switch_workspace(connection, screen, new_desktop);
                         }
                     }
                     else if (cm->type == ewmh._NET_ACTIVE_WINDOW) {
-                        xcb_window_t win = cm->window;
-                        // Find and focus this window
-                        for (int i = 0; i < MAX_WORKSPACES; ++i) {
-                            auto it = std::find(workspaces[i].windows.begin(),
-                                              workspaces[i].windows.end(), win);
-                            if (it != workspaces[i].windows.end()) {
-                                if (i != current_workspace) {
-                                    switch_workspace(connection, screen, i);
-                                }
-                                focus_client(connection, win);
-                                break;
-                            }
-                        }
+                        activate_window(connection, screen, cm->window);
                     }
                     break;
                 }
 
                 default: {
+                    if (sync_extension.present && (event->response_type & ~0x80) == sync_extension.first_event + XCB_SYNC_ALARM_NOTIFY) {
+                        handle_sync_alarm(connection, (xcb_sync_alarm_notify_event_t*)event);
+                        break;
+                    }
                     std::cout << "Unknown event type: " << (event->response_type & ~0x80) << std::endl;
                     break;
                 }
@@ -1052,6 +3855,11 @@ int main() {
         }
         end_loop:;
     }
+    thaw_all_processes();
+    publish_frozen_processes(connection, screen);
+    xcb_flush(connection);
+    close_state_export();
+    close_trace();
     xcb_disconnect(connection);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,76 @@
+// Layout of the state snapshot swm publishes in the POSIX shared-memory
+// segment SWM_STATE_NAME. Bars and pagers map it read-only and copy it out
+// with swm_state_read(); no X round trip or syscall is needed per update.
+//
+// The segment is written under a seqlock: sequence is odd while swm is
+// writing and is bumped to the next even value once the snapshot is
+// consistent. A reader retries when the sequence changed during its copy.
+#ifndef SWM_STATE_H
+#define SWM_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SWM_STATE_NAME "/swm-state"
+#define SWM_STATE_MAGIC 0x73776d31u // "swm1"
+#define SWM_STATE_VERSION 3
+#define SWM_STATE_MAX_WORKSPACES 32
+#define SWM_STATE_MAX_WINDOWS 512
+
+enum {
+    SWM_STATE_FLOATING = 1 << 0,
+    SWM_STATE_FULLSCREEN = 1 << 1,
+    SWM_STATE_SCRATCHPAD = 1 << 2,
+    SWM_STATE_HIDDEN = 1 << 3,
+};
+
+struct swm_state_window {
+    uint32_t window;
+    int32_t workspace; // -1 for scratchpads, which follow every workspace
+    uint32_t flags;    // SWM_STATE_* bits
+    int16_t x, y;
+    uint16_t width, height;
+    char wm_class[32]; // truncated, always NUL terminated
+    char title[96];
+};
+
+struct swm_state_workspace {
+    uint32_t id; // workspaces are sparse; only those in use are listed
+    uint32_t window_count;
+    uint32_t focused_window;
+    uint32_t fullscreen_window;
+};
+
+struct swm_state {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t current_workspace;
+    uint32_t focused_window;
+    int32_t gap_size;
+    float master_ratio;
+    int32_t work_area_x, work_area_y, work_area_width, work_area_height;
+    uint32_t workspace_count; // entries of workspaces[] that are valid
+    uint32_t window_count; // entries of windows[] that are valid
+    // What swm actually has. Larger than the counts above when the arrays
+    // were too small and the snapshot is truncated.
+    uint32_t total_workspace_count;
+    uint32_t total_window_count;
+    struct swm_state_workspace workspaces[SWM_STATE_MAX_WORKSPACES];
+    struct swm_state_window windows[SWM_STATE_MAX_WINDOWS];
+};
+
+// Copies a consistent snapshot out of the mapped segment.
+static inline void swm_state_read(const struct swm_state* shared, struct swm_state* out) {
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        memcpy(out, shared, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&shared->sequence, __ATOMIC_RELAXED);
+        if (before == after) return;
+    } while (1);
+}
+
+#endif